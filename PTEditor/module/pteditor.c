@@ -12,6 +12,7 @@
 #include <linux/ptrace.h>
 #include <linux/proc_fs.h>
 #include <linux/kprobes.h>
+#include <linux/vmalloc.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
 #include <linux/mmap_lock.h>
@@ -227,6 +228,36 @@ invalidate_tlb_kernel(unsigned long addr) {
 #endif
 }
 
+static void
+_invalidate_tlb_batch(void *info) {
+  ptedit_update_batch_t* batch = (ptedit_update_batch_t*) info;
+  size_t i;
+  for(i = 0; i < batch->count; i++) {
+    _invalidate_tlb((void*) batch->entries[i].vaddr);
+  }
+}
+
+/* One TLB shootdown for all addresses of a batch */
+static void
+invalidate_tlb_batch(struct mm_struct* mm, ptedit_update_batch_t* batch) {
+  size_t i, start = ~0ul, end = 0;
+  if(batch->count == 0) return;
+  if(invalidate_tlb == invalidate_tlb_custom) {
+    on_each_cpu(_invalidate_tlb_batch, batch, 1);
+    return;
+  }
+  for(i = 0; i < batch->count; i++) {
+    if(batch->entries[i].vaddr < start) start = batch->entries[i].vaddr;
+    if(batch->entries[i].vaddr > end) end = batch->entries[i].vaddr;
+  }
+#if defined(__i386__) || defined(__x86_64__)
+  /* Large ranges become a full flush of the mm */
+  flush_tlb_mm_range_func(mm, start, end + real_page_size, real_page_shift, false);
+#elif defined(__aarch64__)
+  flush_tlb_mm(mm);
+#endif
+}
+
 static void _set_pat(void* _pat) {
 #if defined(__i386__) || defined(__x86_64__)
     int low, high;
@@ -422,6 +453,46 @@ static int update_vm(ptedit_entry_t* new_entry, int lock) {
 }
 
 
+static int update_vm_batch(ptedit_update_batch_t* batch, int lock) {
+  vm_t entry;
+  size_t i;
+  struct mm_struct *mm = get_mm(batch->pid);
+  if(!mm) return 1;
+
+  if(batch->flags & PTEDIT_BATCH_FLUSH_ONLY) {
+    invalidate_tlb_batch(mm, batch);
+    return 0;
+  }
+
+  /* Lock mm */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+  if(lock) mmap_write_lock(mm);
+#else
+  if(lock) down_write(&mm->mmap_sem);
+#endif
+
+  /* Update entries */
+  for(i = 0; i < batch->count; i++) {
+    entry.pid = batch->pid;
+    resolve_vm(batch->entries[i].vaddr, &entry, 0);
+    if(entry.valid & PTEDIT_VALID_MASK_PTE) {
+      set_pte(entry.pte, native_make_pte(batch->entries[i].pte));
+    }
+  }
+
+  invalidate_tlb_batch(mm, batch);
+
+  /* Unlock mm */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+  if(lock) mmap_write_unlock(mm);
+#else
+  if(lock) up_write(&mm->mmap_sem);
+#endif
+
+  return 0;
+}
+
+
 static void vm_to_user(ptedit_entry_t* user, vm_t* vm) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
 #if CONFIG_PGTABLE_LEVELS > 4
@@ -469,6 +540,25 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned lon
         update_vm(&vm_user, !mm_is_locked);
         return 0;
     }
+    case PTEDITOR_IOCTL_CMD_VM_UPDATE_BATCH:
+    {
+        ptedit_update_batch_t batch;
+        ptedit_pte_update_t* user_entries;
+        int ret;
+        (void)from_user(&batch, (void*)ioctl_param, sizeof(batch));
+        if(batch.count > PTEDIT_BATCH_MAX_ENTRIES) return -EINVAL;
+        if(batch.count == 0) return 0;
+        user_entries = batch.entries;
+        batch.entries = vmalloc(batch.count * sizeof(ptedit_pte_update_t));
+        if(!batch.entries) return -ENOMEM;
+        if(from_user(batch.entries, user_entries, batch.count * sizeof(ptedit_pte_update_t))) {
+          vfree(batch.entries);
+          return -EFAULT;
+        }
+        ret = update_vm_batch(&batch, !mm_is_locked);
+        vfree(batch.entries);
+        return ret ? -ESRCH : 0;
+    }
     case PTEDITOR_IOCTL_CMD_VM_LOCK:
     {
         struct mm_struct *mm = current->active_mm;
@@ -90,6 +90,34 @@ typedef struct {
     size_t root;
 } ptedit_paging_t;
 
+/**
+ * New page-table entry of a virtual address, for batched updates
+ */
+typedef struct {
+    /** Virtual address */
+    size_t vaddr;
+    /** Page table entry */
+    size_t pte;
+} ptedit_pte_update_t;
+
+/**
+ * Structure to update the page-table entries of many virtual addresses at once
+ */
+typedef struct {
+    /** Process ID */
+    size_t pid;
+    /** Number of entries (at most PTEDIT_BATCH_MAX_ENTRIES) */
+    size_t count;
+    /** PTEDIT_BATCH_* flags */
+    size_t flags;
+    /** Virtual addresses and their new page-table entries */
+    ptedit_pte_update_t* entries;
+} ptedit_update_batch_t;
+
+/** Only invalidate the TLB for the addresses, the entries are not written */
+#define PTEDIT_BATCH_FLUSH_ONLY (1<<0)
+#define PTEDIT_BATCH_MAX_ENTRIES (1<<16)
+
 #define PTEDIT_VALID_MASK_PGD (1<<0)
 #define PTEDIT_VALID_MASK_P4D (1<<1)
 #define PTEDIT_VALID_MASK_PUD (1<<2)
@@ -140,6 +168,9 @@ typedef struct {
 
 #define PTEDITOR_IOCTL_CMD_SWITCH_TLB_INVALIDATION \
   _IOR(PTEDITOR_IOCTL_MAGIC_NUMBER, 13, size_t)
+
+#define PTEDITOR_IOCTL_CMD_VM_UPDATE_BATCH \
+  _IOR(PTEDITOR_IOCTL_MAGIC_NUMBER, 14, size_t)
 #else
 #define PTEDITOR_READ_PAGE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define PTEDITOR_WRITE_PAGE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_READ_DATA)
@@ -654,6 +654,68 @@ ptedit_fnc void ptedit_invalidate_tlb(void* address) {
 #endif
 }
 
+// ---------------------------------------------------------------------------
+static int ptedit_update_batch_ioctl(pid_t pid, ptedit_pte_update_t* entries, size_t count, size_t flags) {
+#if defined(LINUX)
+    ptedit_update_batch_t batch;
+    batch.pid = (size_t)pid;
+    batch.count = count;
+    batch.flags = flags;
+    batch.entries = entries;
+    return (int) ioctl(ptedit_fd, PTEDITOR_IOCTL_CMD_VM_UPDATE_BATCH, (size_t)&batch);
+#else
+    return -1;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+ptedit_fnc void ptedit_update_batch(pid_t pid, ptedit_pte_update_t* entries, size_t count) {
+    int kernel = (ptedit_update == ptedit_update_kernel);
+    if (!kernel) {
+        // write the entries through physical memory, the module only flushes
+        ptedit_phys_write_t pset = (ptedit_update == ptedit_update_user) ? ptedit_phys_write_pwrite : ptedit_phys_write_map;
+        for (size_t i = 0; i < count; i++) {
+            ptedit_entry_t current = ptedit_resolve((void*)entries[i].vaddr, pid);
+            if (!(current.valid & PTEDIT_VALID_MASK_PTE)) continue;
+            size_t pti = (entries[i].vaddr >> ptedit_paging_definition.page_offset) % (1ull << ptedit_paging_definition.pt_entries);
+            pset((size_t)ptedit_cast(current.pmd, ptedit_pmd_t).pfn * ptedit_pfn_multiply + pti * ptedit_entry_size, entries[i].pte);
+        }
+    }
+
+    for (size_t done = 0; done < count; done += PTEDIT_BATCH_MAX_ENTRIES) {
+        size_t n = (count - done < PTEDIT_BATCH_MAX_ENTRIES) ? count - done : PTEDIT_BATCH_MAX_ENTRIES;
+        if (ptedit_update_batch_ioctl(pid, entries + done, n, kernel ? 0 : PTEDIT_BATCH_FLUSH_ONLY) == 0) continue;
+        // module without batch support
+        for (size_t i = done; i < done + n; i++) {
+            if (kernel) {
+                ptedit_entry_t vm;
+                memset(&vm, 0, sizeof(vm));
+                vm.pte = entries[i].pte;
+                vm.valid = PTEDIT_VALID_MASK_PTE;
+                ptedit_update_kernel((void*)entries[i].vaddr, pid, &vm);
+            } else {
+                ptedit_invalidate_tlb((void*)entries[i].vaddr);
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+ptedit_fnc void ptedit_invalidate_tlb_batch(void* const* addresses, size_t count) {
+    ptedit_pte_update_t entries[512];
+    size_t n;
+    for (size_t done = 0; done < count; done += n) {
+        n = (count - done < 512) ? count - done : 512;
+        for (size_t i = 0; i < n; i++) {
+            entries[i].vaddr = (size_t)addresses[done + i];
+            entries[i].pte = 0;
+        }
+        if (ptedit_update_batch_ioctl(0, entries, n, PTEDIT_BATCH_FLUSH_ONLY) == 0) continue;
+        // module without batch support
+        for (size_t i = 0; i < n; i++) ptedit_invalidate_tlb(addresses[done + i]);
+    }
+}
+
 // ---------------------------------------------------------------------------
 ptedit_fnc int ptedit_switch_tlb_invalidation(int implementation) {
 #if defined(LINUX)
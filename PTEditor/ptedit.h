@@ -236,6 +236,18 @@ extern ptedit_fnc ptedit_resolve_t ptedit_resolve;
  */
 extern ptedit_fnc ptedit_update_t ptedit_update;
 
+/**
+ * Updates the page-table entries of many virtual addresses of a given process at once.
+ * The entries are written under one lock, and the TLB is flushed once for all of them.
+ * Falls back to one update per entry if the kernel module does not support batches.
+ *
+ * @param[in] pid The pid of the process (0 for own process)
+ * @param[in] entries The virtual addresses and their new page-table entries
+ * @param[in] count The number of entries
+ *
+ */
+ptedit_fnc void ptedit_update_batch(pid_t pid, ptedit_pte_update_t* entries, size_t count);
+
 /**
  * Sets a bit directly in the PTE of an address.
  *
@@ -635,6 +647,15 @@ ptedit_fnc void ptedit_set_paging_root(pid_t pid, size_t root);
   */
 ptedit_fnc void ptedit_invalidate_tlb(void* address);
 
+ /**
+  * Invalidates the TLB for many addresses of the own process on all CPUs, with one shootdown.
+  *
+  * @param[in] addresses The addresses to invalidate
+  * @param[in] count The number of addresses
+  *
+  */
+ptedit_fnc void ptedit_invalidate_tlb_batch(void* const* addresses, size_t count);
+
  /**
   * Change the method used for flushing the TLB (either kernel or custom function)
   *
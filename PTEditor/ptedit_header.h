@@ -91,6 +91,34 @@ typedef struct {
     size_t root;
 } ptedit_paging_t;
 
+/**
+ * New page-table entry of a virtual address, for batched updates
+ */
+typedef struct {
+    /** Virtual address */
+    size_t vaddr;
+    /** Page table entry */
+    size_t pte;
+} ptedit_pte_update_t;
+
+/**
+ * Structure to update the page-table entries of many virtual addresses at once
+ */
+typedef struct {
+    /** Process ID */
+    size_t pid;
+    /** Number of entries (at most PTEDIT_BATCH_MAX_ENTRIES) */
+    size_t count;
+    /** PTEDIT_BATCH_* flags */
+    size_t flags;
+    /** Virtual addresses and their new page-table entries */
+    ptedit_pte_update_t* entries;
+} ptedit_update_batch_t;
+
+/** Only invalidate the TLB for the addresses, the entries are not written */
+#define PTEDIT_BATCH_FLUSH_ONLY (1 << 0)
+#define PTEDIT_BATCH_MAX_ENTRIES (1 << 16)
+
 #define PTEDIT_VALID_MASK_PGD (1 << 0)
 #define PTEDIT_VALID_MASK_P4D (1 << 1)
 #define PTEDIT_VALID_MASK_PUD (1 << 2)
@@ -136,6 +164,9 @@ typedef struct {
 
 #define PTEDITOR_IOCTL_CMD_SWITCH_TLB_INVALIDATION \
     _IOR(PTEDITOR_IOCTL_MAGIC_NUMBER, 13, size_t)
+
+#define PTEDITOR_IOCTL_CMD_VM_UPDATE_BATCH \
+    _IOR(PTEDITOR_IOCTL_MAGIC_NUMBER, 14, size_t)
 #else
 #define PTEDITOR_READ_PAGE \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -398,6 +429,20 @@ ptedit_fnc ptedit_resolve_t ptedit_resolve;
  */
 ptedit_fnc ptedit_update_t ptedit_update;
 
+/**
+ * Updates the page-table entries of many virtual addresses of a given process
+ * at once. The entries are written under one lock, and the TLB is flushed once
+ * for all of them. Falls back to one update per entry if the kernel module
+ * does not support batches.
+ *
+ * @param[in] pid The pid of the process (0 for own process)
+ * @param[in] entries The virtual addresses and their new page-table entries
+ * @param[in] count The number of entries
+ *
+ */
+ptedit_fnc void ptedit_update_batch(pid_t pid, ptedit_pte_update_t* entries,
+                                    size_t count);
+
 /**
  * Sets a bit directly in the PTE of an address.
  *
@@ -779,6 +824,17 @@ ptedit_fnc void ptedit_set_paging_root(pid_t pid, size_t root);
  */
 ptedit_fnc void ptedit_invalidate_tlb(void* address);
 
+/**
+ * Invalidates the TLB for many addresses of the own process on all CPUs, with
+ * one shootdown.
+ *
+ * @param[in] addresses The addresses to invalidate
+ * @param[in] count The number of addresses
+ *
+ */
+ptedit_fnc void ptedit_invalidate_tlb_batch(void* const* addresses,
+                                            size_t count);
+
 /**
  * Change the method used for flushing the TLB (either kernel or custom
  * function)
@@ -1681,6 +1737,87 @@ ptedit_fnc void ptedit_invalidate_tlb(void* address) {
 #endif
 }
 
+// ---------------------------------------------------------------------------
+static int ptedit_update_batch_ioctl(pid_t pid, ptedit_pte_update_t* entries,
+                                     size_t count, size_t flags) {
+#if defined(LINUX)
+    ptedit_update_batch_t batch;
+    batch.pid = (size_t)pid;
+    batch.count = count;
+    batch.flags = flags;
+    batch.entries = entries;
+    return (int)ioctl(ptedit_fd, PTEDITOR_IOCTL_CMD_VM_UPDATE_BATCH,
+                      (size_t)&batch);
+#else
+    return -1;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+ptedit_fnc void ptedit_update_batch(pid_t pid, ptedit_pte_update_t* entries,
+                                    size_t count) {
+    int kernel = (ptedit_update == ptedit_update_kernel);
+    if (!kernel) {
+        // write the entries through physical memory, the module only flushes
+        ptedit_phys_write_t pset = (ptedit_update == ptedit_update_user)
+                                       ? ptedit_phys_write_pwrite
+                                       : ptedit_phys_write_map;
+        for (size_t i = 0; i < count; i++) {
+            ptedit_entry_t current =
+                ptedit_resolve((void*)entries[i].vaddr, pid);
+            if (!(current.valid & PTEDIT_VALID_MASK_PTE)) continue;
+            size_t pti = (entries[i].vaddr >>
+                          ptedit_paging_definition.page_offset) %
+                         (1ull << ptedit_paging_definition.pt_entries);
+            pset((size_t)ptedit_cast(current.pmd, ptedit_pmd_t).pfn *
+                         ptedit_pfn_multiply +
+                     pti * ptedit_entry_size,
+                 entries[i].pte);
+        }
+    }
+
+    for (size_t done = 0; done < count; done += PTEDIT_BATCH_MAX_ENTRIES) {
+        size_t n = (count - done < PTEDIT_BATCH_MAX_ENTRIES)
+                       ? count - done
+                       : PTEDIT_BATCH_MAX_ENTRIES;
+        if (ptedit_update_batch_ioctl(pid, entries + done, n,
+                                      kernel ? 0 : PTEDIT_BATCH_FLUSH_ONLY) ==
+            0)
+            continue;
+        // module without batch support
+        for (size_t i = done; i < done + n; i++) {
+            if (kernel) {
+                ptedit_entry_t vm;
+                memset(&vm, 0, sizeof(vm));
+                vm.pte = entries[i].pte;
+                vm.valid = PTEDIT_VALID_MASK_PTE;
+                ptedit_update_kernel((void*)entries[i].vaddr, pid, &vm);
+            } else {
+                ptedit_invalidate_tlb((void*)entries[i].vaddr);
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+ptedit_fnc void ptedit_invalidate_tlb_batch(void* const* addresses,
+                                            size_t count) {
+    ptedit_pte_update_t entries[512];
+    size_t n;
+    for (size_t done = 0; done < count; done += n) {
+        n = (count - done < 512) ? count - done : 512;
+        for (size_t i = 0; i < n; i++) {
+            entries[i].vaddr = (size_t)addresses[done + i];
+            entries[i].pte = 0;
+        }
+        if (ptedit_update_batch_ioctl(0, entries, n,
+                                      PTEDIT_BATCH_FLUSH_ONLY) == 0)
+            continue;
+        // module without batch support
+        for (size_t i = 0; i < n; i++) ptedit_invalidate_tlb(addresses[done + i]);
+    }
+}
+
 // ---------------------------------------------------------------------------
 ptedit_fnc int ptedit_switch_tlb_invalidation(int implementation) {
 #if defined(LINUX)
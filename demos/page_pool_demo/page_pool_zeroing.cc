@@ -0,0 +1,85 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "phy_page_pool.h"
+
+/*
+ * Exhaust a small page pool, give all pages back, and check that the
+ * background thread zeroes pages again: it goes idle while the pool is dry.
+ */
+
+static const size_t PAGE_SIZE = 4096;
+static const size_t POOLS = 4;
+static const size_t PAGES_PER_POOL = 16;
+static const size_t TARGET = 32;
+
+// wait up to a second for target zeroed pages
+static bool wait_zeroed(MemoryPool &pool, size_t target) {
+    for (int i = 0; i < 1000 && pool.zeroed_pages() < target; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return pool.zeroed_pages() >= target;
+}
+
+static bool is_zero(const void *page) {
+    const char *p = (const char *)page;
+    for (size_t i = 0; i < PAGE_SIZE; i++) {
+        if (p[i] != 0) return false;
+    }
+    return true;
+}
+
+int main() {
+    MemoryPool pool(POOLS, PAGES_PER_POOL, PAGE_SIZE, false, false);
+    pool.start_zeroing(TARGET);
+    if (!wait_zeroed(pool, TARGET)) {
+        fprintf(stderr, "initial zeroing stalled: zeroed_pages=%zu\n",
+                pool.zeroed_pages());
+        return EXIT_FAILURE;
+    }
+
+    for (int round = 0; round < 3; round++) {
+        // dirty every page, the zeroing thread finds the pool dry
+        std::vector<void *> pages;
+        while (void *page = pool.allocate()) {
+            memset(page, 0x5a, PAGE_SIZE);
+            pages.push_back(page);
+        }
+        if (pages.size() != pool.capacity()) {
+            fprintf(stderr, "allocated %zu of %zu pages\n", pages.size(),
+                    pool.capacity());
+            return EXIT_FAILURE;
+        }
+        for (void *page : pages) pool.deallocate(page);
+
+        if (!wait_zeroed(pool, TARGET)) {
+            fprintf(stderr,
+                    "round %d: zeroing stalled: zeroed_pages=%zu free=%zu\n",
+                    round, pool.zeroed_pages(), pool.free_pages());
+            return EXIT_FAILURE;
+        }
+        // take half, the thread refills them
+        pages.clear();
+        for (size_t i = 0; i < TARGET / 2 + 1; i++) {
+            void *page = pool.allocate_zeroed();
+            if (page == nullptr || !is_zero(page)) {
+                fprintf(stderr, "round %d: bad zeroed page\n", round);
+                return EXIT_FAILURE;
+            }
+            pages.push_back(page);
+        }
+        if (!wait_zeroed(pool, TARGET)) {
+            fprintf(stderr, "round %d: refill stalled: zeroed_pages=%zu\n",
+                    round, pool.zeroed_pages());
+            return EXIT_FAILURE;
+        }
+        for (void *page : pages) pool.deallocate(page);
+        printf("round %d: zeroed_pages=%zu free=%zu\n", round,
+               pool.zeroed_pages(), pool.free_pages());
+    }
+    return EXIT_SUCCESS;
+}
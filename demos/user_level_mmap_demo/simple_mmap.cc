@@ -40,7 +40,7 @@ int main(int argc, char *argv[]) {
     while (l < len) {
         c = addr[l];
         printf("Read address %p in %s(): ", addr + l, __func__);
-        printf("%c\n", c);
+        printf("%d\n", c);  // anonymous memory reads as zeros
         l += 1024;
         usleep(100000); /* Slow things down a little */
     }
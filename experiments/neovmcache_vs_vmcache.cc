@@ -1,369 +1,445 @@
+/**
+ * Page fix/unfix cost of buffer manager designs over a memory-mapped file:
+ *
+ *   hash        page table in a hash map, latches in a separate array
+ *   vmcache     pid * page size into the mapping, latches in a separate array
+ *   neovmcache  pid * page size, the latch is the first word of the page
+ *   ul_pool     ul_fix()/ul_unfix() of the user level mmap engine
+ *
+ * Reads fix the page optimistically (validated by a version), writes
+ * exclusively. Every combination of variant, key distribution, write ratio,
+ * thread count and dataset size is run, one CSV line each with the
+ * throughput and the p50/p99 latency of sampled fix calls.
+ */
 #include <fcntl.h>
-#include <string.h>
 #include <sys/mman.h>
-#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
-#include <cassert>
 #include <chrono>
-#include <fstream>
-#include <iostream>
-#include <random>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
-// 假设PageSize和State数组或Header的定义
-constexpr uint64_t PageSize = 4096;
-//constexpr uint64_t NumPages = 736400;  // 示例数据页数量
-constexpr uint64_t NumPages = 2000;  // 示例数据页数量
+#include "ul_buffer_pool.h"
+#include "user_level_mmap.h"
 
-class PageState {
-   private:
-    union {
-        struct {
-            uint64_t evicted : 1;    // 占用1位，表示页面是否被逐出
-            uint64_t marked : 1;     // 占用1位，表示页面是否被标记
-            uint64_t locked : 1;     // 占用1位，表示页面是否被锁定
-            uint64_t reserved : 61;  // 剩余的61位保留未用
-        } bits;
-        uint64_t all;  // 允许直接访问所有位作为一个整体
-    };
+static constexpr uint64_t PAGE_SIZE = 4096;
+// fix latency is measured for one op in LATENCY_SAMPLE
+static constexpr uint64_t LATENCY_SAMPLE = 8;
 
-   public:
-    PageState() : all(0) {}  // 默认构造函数
+// the reads go here, so that they are not optimized away
+static std::atomic<uint64_t> read_sink{0};
 
-    // 检查页面是否被逐出
-    bool isEvicted() const { return bits.evicted == 1; }
-
-    // 设置页面为逐出状态
-    void setEvicted() {
-        bits.evicted = 1;
-        bits.marked = 0;  // 逐出时清除标记状态
-        bits.locked = 0;
+/**
+ * A latch word: bit 63 is the exclusive lock, the rest a version that every
+ * exclusive unlock increments.
+ */
+class Latch {
+   public:
+    static constexpr uint64_t LOCKED = 1ull << 63;
+
+    void lock(std::atomic<uint64_t> &word) {
+        for (;;) {
+            uint64_t v = word.load(std::memory_order_relaxed);
+            if (!(v & LOCKED) &&
+                word.compare_exchange_weak(v, v | LOCKED,
+                                           std::memory_order_acquire))
+                return;
+            std::this_thread::yield();
+        }
     }
 
-    // 检查页面是否被标记
-    bool isMarked() const { return bits.marked == 1; }
-
-    // 设置页面为标记状态
-    void setMarked() { bits.marked = 1; }
+    void unlock(std::atomic<uint64_t> &word) {
+        uint64_t v = word.load(std::memory_order_relaxed);
+        word.store((v & ~LOCKED) + 1, std::memory_order_release);
+    }
 
-    // 检查页面是否解锁
-    bool isUnlocked() const { return bits.locked == 0; }
+    uint64_t read(std::atomic<uint64_t> &word) {
+        uint64_t v;
+        while ((v = word.load(std::memory_order_acquire)) & LOCKED)
+            std::this_thread::yield();
+        return v;
+    }
 
-    void unsafe_lock() { bits.locked = 1; }
+    bool validate(std::atomic<uint64_t> &word, uint64_t v) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return word.load(std::memory_order_relaxed) == v;
+    }
+};
 
-    void setUnlocked() { bits.locked = 0; }
+class Xorshift64 {
+   public:
+    explicit Xorshift64(uint64_t seed) : state_(seed | 1) {}
 
-    uint64_t locked_state() {
-        auto tmp = *this;
-        tmp.unsafe_lock();
-        return tmp.all;
+    uint64_t next() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 7;
+        state_ ^= state_ << 17;
+        return state_;
     }
 
-    uint64_t state() { return all; }
-};
+    // uniform in [0, 1)
+    double next_double() { return (next() >> 11) * (1.0 / (1ull << 53)); }
 
-struct PageStatePadding {
-    PageState s;
-    char padding[5040]; // emulate large disk sinario
+   private:
+    uint64_t state_;
 };
 
-class XorshiftRNG {
-public:
-    XorshiftRNG(uint32_t seed = 123456789) : state(seed) {}
+/**
+ * Zipfian page ids in [0, n) (Gray et al., as in YCSB). Ranks are scattered
+ * over the dataset by a multiplicative hash, so hot pages are not adjacent.
+ */
+class Zipf {
+   public:
+    Zipf(uint64_t n, double theta) : n_(n), theta_(theta) {
+        double zeta2 = 1 + std::pow(0.5, theta);
+        zetan_ = 0;
+        for (uint64_t i = 1; i <= n; i++) zetan_ += 1 / std::pow(i, theta);
+        alpha_ = 1 / (1 - theta);
+        eta_ = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan_);
+    }
 
-    uint32_t next() {
-        uint32_t x = state;
-        x ^= x << 13;
-        state = x;
-        return x;
+    uint64_t next(Xorshift64 &rng) const {
+        double u = rng.next_double();
+        double uz = u * zetan_;
+        uint64_t rank;
+        if (uz < 1) {
+            rank = 0;
+        } else if (uz < 1 + std::pow(0.5, theta_)) {
+            rank = 1;
+        } else {
+            rank = (uint64_t)(n_ * std::pow(eta_ * u - eta_ + 1, alpha_));
+        }
+        return (std::min(rank, n_ - 1) * 0x9e3779b97f4a7c15ull) % n_;
     }
 
-private:
-    uint32_t state;
+   private:
+    uint64_t n_;
+    double theta_;
+    double zetan_, alpha_, eta_;
 };
 
-class LinearCongruentialGenerator {
-public:
-    LinearCongruentialGenerator(unsigned long a = 1664525, unsigned long c = 1013904223, unsigned long m = 4294967296, unsigned long seed = 42)
-        : a(a), c(c), m(m), current(seed) {}
-
-    unsigned long next() {
-        current = (a * current + c) % m;
-        return current;
-    }
-
-private:
-    unsigned long a, c, m, current;
+/**
+ * The buffer managers under test, over num_pages pages of base. fix()
+ * returns the page address and, for reads, the version unfix() validates.
+ */
+struct Dataset {
+    char *base;
+    uint64_t num_pages;
+    std::vector<std::atomic<uint64_t>> latches;
+    std::unordered_map<uint64_t, char *> table;
+    ul_pool *pool;
 };
 
-bool compareAndSwap(std::atomic<uint64_t> *value, uint64_t expected,
-                    uint64_t desired) {
-    // 尝试以原子方式将value的值从expected更新为desired
-    return value->compare_exchange_strong(expected, desired,
-                                          std::memory_order_relaxed);
+enum Variant { HASH, VMCACHE, NEOVMCACHE, UL_POOL };
+static const char *const VARIANT_NAMES[] = {"hash", "vmcache", "neovmcache",
+                                            "ul_pool"};
+
+template <Variant V>
+static char *fix(Dataset &ds, uint64_t pid, bool write, uint64_t *version) {
+    Latch latch;
+    switch (V) {
+        case HASH:
+        case VMCACHE: {
+            char *page = V == HASH ? ds.table.find(pid)->second
+                                   : ds.base + pid * PAGE_SIZE;
+            if (write)
+                latch.lock(ds.latches[pid]);
+            else
+                *version = latch.read(ds.latches[pid]);
+            return page;
+        }
+        case NEOVMCACHE: {
+            char *page = ds.base + pid * PAGE_SIZE;
+            auto &word = *reinterpret_cast<std::atomic<uint64_t> *>(page);
+            if (write)
+                latch.lock(word);
+            else
+                *version = latch.read(word);
+            return page;
+        }
+        case UL_POOL:
+            return (char *)ul_fix(ds.pool, pid,
+                                  write ? UL_LATCH_EXCLUSIVE
+                                        : UL_LATCH_OPTIMISTIC,
+                                  version);
+    }
+    return nullptr;
 }
 
-PageStatePadding *state;
-
-void *vmcache_virtMem;  // base addr from mmap
-// 假设vmcache和neovmcache状态管理的模拟实现
-// 这些函数需要根据实际的缓冲区管理器实现进行定义
-void *vmcache_fix(uint64_t pid) {
-    // 实现细节
-    uint64_t ofs = pid * PageSize;
-    while (true) {
-        auto s = state[pid].s;
-        if (s.isEvicted()) {
-            // nerver reached in this experiment
-            assert(false);
-            if (compareAndSwap(
-                    reinterpret_cast<std::atomic<uint64_t> *>(&state[pid].s),
-                    s.state(), s.locked_state())) {
-                // read from disk.
-                // return vaddr.
+// false if an optimistic read must be retried
+template <Variant V>
+static bool unfix(Dataset &ds, uint64_t pid, char *page, bool write,
+                  uint64_t version) {
+    Latch latch;
+    switch (V) {
+        case HASH:
+        case VMCACHE:
+            if (write) {
+                latch.unlock(ds.latches[pid]);
+                return true;
             }
-        } else if (s.isMarked() || s.isUnlocked()) {
-            if (compareAndSwap(reinterpret_cast<std::atomic<uint64_t> *>(&state[pid]), s.state(), s.locked_state())) {
-                return reinterpret_cast<void *>(reinterpret_cast<uint64_t>(vmcache_virtMem) + ofs);
+            return latch.validate(ds.latches[pid], version);
+        case NEOVMCACHE: {
+            auto &word = *reinterpret_cast<std::atomic<uint64_t> *>(page);
+            if (write) {
+                latch.unlock(word);
+                return true;
             }
-            //s.unsafe_lock();
-            //return reinterpret_cast<void *>(
-            //    reinterpret_cast<uint64_t>(vmcache_virtMem) + ofs);
+            return latch.validate(word, version);
         }
+        case UL_POOL:
+            return ul_unfix(ds.pool, pid,
+                            write ? UL_LATCH_EXCLUSIVE : UL_LATCH_OPTIMISTIC,
+                            version) == 0;
     }
+    return true;
 }
 
-void vmcache_unfix(uint64_t pid, void *vaddr) { state[pid].s.setUnlocked(); }
-
-PageState *buf_tags;
-std::unordered_map<uint64_t, void *> *buf_table;
-void* hash_fix(uint64_t pid) {
-    while (true) {
-        auto s = buf_tags[pid];
-        if (s.isEvicted()) {
-            // nerver reached in this experiment
-            assert(false);
-            if (compareAndSwap(
-                    reinterpret_cast<std::atomic<uint64_t> *>(&state[pid].s),
-                    s.state(), s.locked_state())) {
-                // read from disk.
-                // return vaddr.
+struct Result {
+    double ops_per_sec;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+};
+
+template <Variant V>
+static Result run(Dataset &ds, const Zipf *zipf, unsigned write_pct,
+                  unsigned threads, uint64_t ops_per_thread) {
+    std::vector<std::vector<uint64_t>> latencies(threads);
+    std::vector<std::thread> workers;
+    std::atomic<unsigned> ready{0};
+    std::atomic<bool> go{false};
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            Xorshift64 rng(0x5eed + t * 7919);
+            std::vector<uint64_t> &lat = latencies[t];
+            lat.reserve(ops_per_thread / LATENCY_SAMPLE + 1);
+            uint64_t acc = 0;
+            ready++;
+            while (!go.load(std::memory_order_acquire)) {
             }
-        } else if (s.isMarked() || s.isUnlocked()) {
-            if (compareAndSwap(reinterpret_cast<std::atomic<uint64_t> *>(&buf_tags[pid]), s.state(), s.locked_state())) {
-                return (*buf_table)[pid];
+            for (uint64_t i = 0; i < ops_per_thread; i++) {
+                uint64_t pid =
+                    zipf ? zipf->next(rng) : rng.next() % ds.num_pages;
+                bool write = rng.next() % 100 < write_pct;
+                bool sample = i % LATENCY_SAMPLE == 0;
+                uint64_t version = 0;
+                for (;;) {
+                    auto start = std::chrono::steady_clock::now();
+                    char *page = fix<V>(ds, pid, write, &version);
+                    if (sample) {
+                        lat.push_back(
+                            std::chrono::duration_cast<
+                                std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - start)
+                                .count());
+                        sample = false;
+                    }
+                    // past the latch word of neovmcache
+                    uint64_t *data = (uint64_t *)page + 2;
+                    if (write) {
+                        *data += 1;
+                    } else {
+                        acc += __atomic_load_n(data, __ATOMIC_RELAXED);
+                    }
+                    if (unfix<V>(ds, pid, page, write, version)) break;
+                }
             }
-            //s.unsafe_lock();
-            //return reinterpret_cast<void *>(
-            //    reinterpret_cast<uint64_t>(vmcache_virtMem) + ofs);
-        }
+            read_sink += acc;
+        });
     }
-}
-void hash_unfix(uint64_t pid, void *vaddr) { buf_tags[pid].setUnlocked(); }
-
-void *neovmcache_virtMem;
-void *neovmcache_fix(uint64_t pid) {
-    uint64_t ofs = pid * PageSize;
-    PageState *s_ptr = reinterpret_cast<PageState *>(
-        reinterpret_cast<uint64_t>(neovmcache_virtMem) + ofs);
-    uint64_t *data = (uint64_t *)s_ptr;
-    while (true) {
-        auto s = *s_ptr;
-        if (s.isEvicted()) {
-            // never reach
-            assert(false);
-        } else if ((s.isMarked() || s.isUnlocked()) && data[1] == 0) {
-            if (compareAndSwap(reinterpret_cast<std::atomic<uint64_t> *>(s_ptr), s.state(), s.locked_state())) {
-                return reinterpret_cast<void *>(s_ptr);
-            }
-            //s.unsafe_lock();
-            //return reinterpret_cast<void *>(s_ptr);
-        }
+    while (ready.load() < threads) {
     }
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto &w : workers) w.join();
+    double secs = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+
+    std::vector<uint64_t> all;
+    for (auto &lat : latencies) all.insert(all.end(), lat.begin(), lat.end());
+    auto percentile = [&all](double p) -> uint64_t {
+        if (all.empty()) return 0;
+        size_t k = std::min(all.size() - 1, (size_t)(p * all.size()));
+        std::nth_element(all.begin(), all.begin() + k, all.end());
+        return all[k];
+    };
+    Result r;
+    r.ops_per_sec = threads * ops_per_thread / secs;
+    r.p50_ns = percentile(0.50);
+    r.p99_ns = percentile(0.99);
+    return r;
 }
 
-void neovmcache_unfix(uint64_t pid, void *vaddr) {
-    // 实现细节
-    //uint64_t ofs = pid * PageSize;
-    //PageState *s_ptr = reinterpret_cast<PageState *>(ofs + reinterpret_cast<uint64_t>(neovmcache_virtMem));
-    PageState *s_ptr = reinterpret_cast<PageState *>(vaddr);
-    s_ptr->setUnlocked();
-}
-
-// 生成随机访问的页ID
-uint64_t getRandomPageID() {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<uint64_t> dis(0, NumPages - 1);
-    return dis(gen);
-}
-
-// 执行N次操作的函数
-uint64_t acc;
-
-template <typename FixFunc, typename UnfixFunc>
-double performTest(FixFunc fix, UnfixFunc unfix, uint64_t N) {
-    auto start = std::chrono::high_resolution_clock::now();
-    //XorshiftRNG rnd_gen;
-    LinearCongruentialGenerator rnd_gen;
-
-
-    for (uint64_t i = 0; i < N; ++i) {
-        uint64_t pid = rnd_gen.next() % NumPages;
-        auto vaddr = fix(pid);
-        // read from the data page
-        uint64_t *data = (uint64_t *)vaddr;
-        acc += data[2];
-        data[2] = acc;
-        unfix(pid, vaddr);
+static Result run_variant(Variant v, Dataset &ds, const Zipf *zipf,
+                          unsigned write_pct, unsigned threads,
+                          uint64_t ops) {
+    switch (v) {
+        case HASH:
+            return run<HASH>(ds, zipf, write_pct, threads, ops);
+        case VMCACHE:
+            return run<VMCACHE>(ds, zipf, write_pct, threads, ops);
+        case NEOVMCACHE:
+            return run<NEOVMCACHE>(ds, zipf, write_pct, threads, ops);
+        case UL_POOL:
+            return run<UL_POOL>(ds, zipf, write_pct, threads, ops);
     }
-
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::milli> duration = end - start;
-    return duration.count();
+    return {};
 }
 
-int check_data_file(std::string &data_file);
-
-int main() {
-    state = (PageStatePadding *)mmap(NULL, NumPages * sizeof(PageStatePadding), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
-    if (state == MAP_FAILED) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+static std::vector<uint64_t> parse_list(const char *arg) {
+    std::vector<uint64_t> list;
+    std::string s(arg);
+    size_t pos = 0;
+    while (pos <= s.size()) {
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.size();
+        list.push_back(strtoull(s.substr(pos, comma - pos).c_str(), nullptr, 0));
+        pos = comma + 1;
     }
+    return list;
+}
 
-    buf_tags = (PageState *)mmap(NULL, NumPages * sizeof(PageState), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
-    if (state == MAP_FAILED) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
-    }
-
-    buf_table = new std::unordered_map<uint64_t, void*>();
-
-    uint64_t N = 10000000;  // 设置操作次数
-
-    // check if data file is exist
-    std::string data_file("experiment1_data_file");
-
-    // make sure data file have at least NumPages pages
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-t threads,...] [-s pages,...] [-w write%%,...] "
+            "[-d uniform|zipf|both] [-z theta] [-n ops per thread] "
+            "[-f data file] [-u]\n"
+            "  -u also runs the ul_pool variant\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
 
-    int fd = check_data_file(data_file);
-    // 映射虚拟内存
-    vmcache_virtMem = mmap(NULL, NumPages * PageSize, PROT_READ | PROT_WRITE,
-                           MAP_PRIVATE | MAP_POPULATE, fd, 0);
-    if (vmcache_virtMem == MAP_FAILED) {
-        std::cerr << "Failed to mmap data file: " << data_file << std::endl;
-        close(fd);
-        return -1;
-    }
-    // 使用madvise通知内核预加载所有页面
-    if (madvise(vmcache_virtMem, NumPages * PageSize, MADV_WILLNEED) != 0) {
-        std::cerr << "madvise failed" << std::endl;
-        munmap(vmcache_virtMem, NumPages * PageSize);
-        close(fd);
-        return -1;
+int main(int argc, char **argv) {
+    unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<uint64_t> thread_counts;
+    for (unsigned t = 1; t <= hw; t *= 2) thread_counts.push_back(t);
+    // 4MiB, 64MiB (around the LLC), 1GiB
+    std::vector<uint64_t> sizes = {1024, 16384, 262144};
+    std::vector<uint64_t> write_pcts = {0, 5, 50};
+    bool uniform = true, zipfian = true, with_ul_pool = false;
+    double theta = 0.99;
+    uint64_t ops = 1000000;
+    const char *data_file = "experiment1_data_file";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:w:d:z:n:f:u")) != -1) {
+        switch (opt) {
+            case 't':
+                thread_counts = parse_list(optarg);
+                break;
+            case 's':
+                sizes = parse_list(optarg);
+                break;
+            case 'w':
+                write_pcts = parse_list(optarg);
+                break;
+            case 'd':
+                uniform = !strcmp(optarg, "uniform") || !strcmp(optarg, "both");
+                zipfian = !strcmp(optarg, "zipf") || !strcmp(optarg, "both");
+                if (!uniform && !zipfian) usage(argv[0]);
+                break;
+            case 'z':
+                theta = atof(optarg);
+                break;
+            case 'n':
+                ops = strtoull(optarg, nullptr, 0);
+                break;
+            case 'f':
+                data_file = optarg;
+                break;
+            case 'u':
+                with_ul_pool = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
     }
 
-    if (mlock(vmcache_virtMem, NumPages * PageSize) != 0) {
-        std::cerr << "mlock failed" << std::endl;
-        munmap(vmcache_virtMem, NumPages * PageSize);
-        close(fd);
-        return -1;
+    uint64_t max_pages = *std::max_element(sizes.begin(), sizes.end());
+    if (with_ul_pool) {
+        ul_config config;
+        memset(&config, 0, sizeof(config));
+        config.pool_pages = max_pages + max_pages / 8;
+        ul_init(&config);
     }
 
-    // init buf_table
-    for (uint64_t i = 0; i < NumPages; i++) {
-        (*buf_table)[i] = (void *)((uint64_t)vmcache_virtMem + PageSize * i);
+    int fd = open(data_file, O_RDWR | O_CREAT, 0666);
+    if (fd == -1 || ftruncate(fd, max_pages * PAGE_SIZE) == -1) {
+        perror(data_file);
+        return EXIT_FAILURE;
     }
-    neovmcache_virtMem = vmcache_virtMem;
-
-    // test hash table buffer manager
-    double HashTableTime = performTest(hash_fix, hash_unfix, N);
-    std::cout << "HashTable, N = " << N << ", Time (ms): " << HashTableTime
-              << std::endl;
-
-    std::cout << "HashTable IOPS: " << N / (HashTableTime / 1000) << std::endl;
-
-    // 测试vmcache
-    double vmcacheTime = performTest(vmcache_fix, vmcache_unfix, N);
-    std::cout << "vmcache, N = " << N << ", Time (ms): " << vmcacheTime
-              << std::endl;
 
-    std::cout << "vmcache IOPS: " << N / (vmcacheTime / 1000) << std::endl;
-    // 测试neovmcache
-    double neovmcacheTime = performTest(neovmcache_fix, neovmcache_unfix, N);
-    std::cout << "neovmcache, N = " << N << ", Time (ms): " << neovmcacheTime
-              << std::endl;
-
-    // 计算IOPS
-    std::cout << "neovmcache IOPS: " << N / (neovmcacheTime / 1000)
-              << std::endl;
-
-    return 0;
-}
-
-int check_data_file(std::string &data_file) {
-    // 检查数据文件是否存在
-    std::ifstream file(data_file);
-    if (!file.good()) {
-        std::cerr << "Data file does not exist: " << data_file
-                  << ". Creating..." << std::endl;
-
-        // 创建并打开文件
-        int fd = open(data_file.c_str(), O_RDWR | O_CREAT, 0666);
-        if (fd == -1) {
-            std::cerr << "Failed to create data file: " << data_file
-                      << std::endl;
-            return -1;
+    printf("variant,distribution,write_pct,threads,pages,ops_per_sec,p50_ns,"
+           "p99_ns\n");
+    for (uint64_t pages : sizes) {
+        Dataset ds;
+        ds.num_pages = pages;
+        ds.base = (char *)mmap(nullptr, pages * PAGE_SIZE,
+                               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               fd, 0);
+        if (ds.base == MAP_FAILED) {
+            perror("mmap");
+            return EXIT_FAILURE;
         }
-
-        // 扩展文件到所需大小
-        off_t fileSize = NumPages * PageSize;
-        if (lseek(fd, fileSize - 1, SEEK_SET) == -1) {
-            std::cerr << "Failed to extend data file: " << data_file
-                      << std::endl;
-            close(fd);
-            return -1;
+        // no page faults in the measurements, if the limit allows
+        mlock(ds.base, pages * PAGE_SIZE);
+        memset(ds.base, 0, pages * PAGE_SIZE);
+        ds.latches = std::vector<std::atomic<uint64_t>>(pages);
+        ds.table.reserve(pages);
+        for (uint64_t pid = 0; pid < pages; pid++)
+            ds.table[pid] = ds.base + pid * PAGE_SIZE;
+        ds.pool = nullptr;
+        if (with_ul_pool) {
+            ds.pool = ul_pool_open(fd, pages, MAP_SHARED);
+            if (ds.pool == nullptr) {
+                perror("ul_pool_open");
+                return EXIT_FAILURE;
+            }
+            // fault every page in before measuring
+            for (uint64_t pid = 0; pid < pages; pid++) {
+                uint64_t version;
+                char *page = (char *)ul_fix(ds.pool, pid, UL_LATCH_OPTIMISTIC,
+                                            &version);
+                *(volatile char *)page;
+                ul_unfix(ds.pool, pid, UL_LATCH_OPTIMISTIC, version);
+            }
         }
 
-        // 写入最后一个字节以扩展文件
-        if (write(fd, "", 1) != 1) {
-            std::cerr << "Failed to write last byte to data file: " << data_file
-                      << std::endl;
-            close(fd);
-            return -1;
+        std::vector<std::unique_ptr<Zipf>> dists;
+        if (uniform) dists.emplace_back(nullptr);
+        if (zipfian) dists.emplace_back(new Zipf(pages, theta));
+
+        for (auto &zipf : dists) {
+            for (uint64_t write_pct : write_pcts) {
+                for (uint64_t threads : thread_counts) {
+                    for (int v = HASH; v <= UL_POOL; v++) {
+                        if (v == UL_POOL && !with_ul_pool) continue;
+                        Result r = run_variant((Variant)v, ds, zipf.get(),
+                                               write_pct, threads, ops);
+                        printf("%s,%s,%lu,%lu,%lu,%.0f,%lu,%lu\n",
+                               VARIANT_NAMES[v], zipf ? "zipf" : "uniform",
+                               write_pct, threads, pages, r.ops_per_sec,
+                               r.p50_ns, r.p99_ns);
+                        fflush(stdout);
+                    }
+                }
+            }
         }
 
-        close(fd);
-        std::cout << "Data file created and extended to required size."
-                  << std::endl;
-    } else {
-        file.close();
+        if (ds.pool) ul_pool_close(ds.pool);
+        munmap(ds.base, pages * PAGE_SIZE);
     }
-
-    // 打开文件准备mmap
-    int fd = open(data_file.c_str(), O_RDWR);
-    if (fd == -1) {
-        std::cerr << "Failed to open data file: " << data_file << std::endl;
-        return -1;
-    }
-
-    // 获取文件大小
-    struct stat sb;
-    if (fstat(fd, &sb) == -1) {
-        std::cerr << "Failed to get file size: " << data_file << std::endl;
-        close(fd);
-        return -1;
-    }
-
-    // 确保文件至少有NumPages页
-    if (sb.st_size < NumPages * PageSize) {
-        std::cerr << "Data file is too small." << std::endl;
-        close(fd);
-        return -1;
-    }
-
-    return fd;
+    close(fd);
+    return 0;
 }
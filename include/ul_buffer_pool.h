@@ -0,0 +1,56 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+/**
+ * \brief A file mapped with ul_mmap() and addressed by page id, for buffer managers (vmcache style).
+ *        Page pid is at a fixed offset of the mapping, so translating a page id is pointer arithmetic. Each page
+ *        has a latch word; a page latched exclusive or shared is never evicted, pages are faulted in on access.
+ */
+struct ul_pool;
+
+/**
+ * \brief Latch modes of ul_fix().
+ */
+enum ul_latch {
+    /** One holder, which may modify the page. */
+    UL_LATCH_EXCLUSIVE = 0,
+    /** Many readers, up to 252 at a time. */
+    UL_LATCH_SHARED,
+    /** No latch is taken: the reads are validated by ul_unfix() and must be retried if it fails. The page may be
+     *  evicted meanwhile, it is faulted in again on the next access. */
+    UL_LATCH_OPTIMISTIC,
+};
+
+/**
+ * \brief Map a file as a pool of 4KiB pages.
+ *
+ * \param fd file to map, opened for reading and writing. The pool keeps its own descriptor.
+ * \param num_pages number of pages, 0 for the file size.
+ * \param flags MAP_SHARED (modified pages are written back to the file) or MAP_PRIVATE.
+ * \return the pool, or NULL with errno set.
+ */
+struct ul_pool *ul_pool_open(int fd, size_t num_pages, int flags);
+
+/**
+ * \brief Unmap the pool, no page may be fixed anymore.
+ */
+int ul_pool_close(struct ul_pool *pool);
+
+/**
+ * \brief Latch page pid and return its address.
+ *
+ * \param version UL_LATCH_OPTIMISTIC: receives the version ul_unfix() validates against, may be NULL otherwise.
+ * \return the page, or NULL with errno set to EINVAL if pid is not a page of the pool.
+ */
+void *ul_fix(struct ul_pool *pool, uint64_t pid, enum ul_latch mode, uint64_t *version);
+
+/**
+ * \brief Release the latch taken by ul_fix(). An exclusive unfix makes the page's optimistic readers fail.
+ *
+ * \param version UL_LATCH_OPTIMISTIC: the version ul_fix() returned, ignored otherwise.
+ * \return 0; UL_LATCH_OPTIMISTIC: -1 if the page was modified since ul_fix(), the reads must be retried. -1 with
+ *         errno set to EINVAL if pid is not a page of the pool.
+ */
+int ul_unfix(struct ul_pool *pool, uint64_t pid, enum ul_latch mode, uint64_t version);
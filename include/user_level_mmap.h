@@ -1,32 +1,214 @@
 #pragma once
 #include <fcntl.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include "sys/mman.h"
 
+/**
+ * \brief How faults are resolved into mappings.
+ */
+enum ul_backend {
+    /** PTEditor if it is available, UL_BACKEND_UFFD_COPY otherwise. */
+    UL_BACKEND_DEFAULT = 0,
+    /** Page table entries pointing at pool frames are written directly through PTEditor. Needs root and the
+     *  PTEditor kernel module. Supports eviction, dirty tracking and huge pages. */
+    UL_BACKEND_PTEDIT,
+    /** Pages are copied in with UFFDIO_COPY (UFFDIO_ZEROPAGE for zeros), no privileges needed. The kernel owns the
+     *  pages: they are never evicted, and write-back writes every resident page. */
+    UL_BACKEND_UFFD_COPY,
+    /** Like UL_BACKEND_UFFD_COPY, but the filled page is moved in with UFFDIO_MOVE instead of copied; the pool frame
+     *  is replaced by a new page on its next use. Needs Linux 6.8, and only serves PROT_READ | PROT_WRITE regions
+     *  (others fall back to UL_BACKEND_UFFD_COPY), which are mlock()ed on fault like the page pool. */
+    UL_BACKEND_UFFD_MOVE,
+    /** Anonymous regions are backed by a memfd: pages are filled through a second mapping of it and mapped with
+     *  UFFDIO_CONTINUE, no copy and no pool frame. The pages are shared with children forked afterwards. Needs
+     *  Linux 5.13, file-backed regions fall back to UL_BACKEND_UFFD_COPY. */
+    UL_BACKEND_UFFD_MINOR,
+};
+
+/**
+ * \brief Process-wide settings of the user level mmap engine.
+ *        Zero-initialize it and only set the fields you care about, zero means default.
+ */
+struct ul_config {
+    /** Backend of regions created by ul_mmap(). Default: UL_BACKEND_DEFAULT. */
+    enum ul_backend backend;
+    /** Number of fault handling threads shared by all regions. Default: number of CPUs, at most 8. */
+    int handler_threads;
+    /** Number of handler threads that serve the faults of one region concurrently, each reading the region's
+     *  userfaultfd with its own buffers. A page faulted by several threads is read and mapped only once. Default:
+     *  all handler threads. */
+    int handlers_per_region;
+    /** Max number of page-fault messages drained from a uffd per read(). Default: 64. */
+    int fault_batch;
+    /** Number of 4KiB physical frames shared by all regions. With UL_BACKEND_PTEDIT, the frames are mapped into
+     *  the regions: they are allocated and mlock()ed at init, and they are the memory budget of all mappings. Once it
+     *  is used up, pages of file-backed regions are evicted (CLOCK on the PTE accessed bit), so a file may be much
+     *  larger than the pool. Anonymous memory is never evicted. Default: 262144 (1GiB). The other backends only
+     *  fill frames and hand them back once mapped, their frames are neither locked nor populated ahead of use.
+     *  Default: a fault-around window per handler thread and per read in flight on its io_uring. */
+    size_t pool_pages;
+    /** Number of free frames a background thread of the lowest priority keeps zeroed, so that writes to anonymous
+     *  memory do not clear a page on the fault path. Default: pool_pages / 16. */
+    size_t prezero_pages;
+    /** Number of 2MiB frames taken from the reserved huge pages (vm.nr_hugepages) at init, for regions mapped with
+     *  MAP_HUGETLB. Such a region is 2MiB aligned, and each 2MiB block entirely inside it is mapped by one PMD
+     *  entry on its first fault. Blocks fall back to 4KiB pages when no huge frame is left. Default: 0 (MAP_HUGETLB
+     *  regions use 4KiB pages). */
+    size_t huge_pool_pages;
+    /** Number of pages evicted at once when the pool runs dry, their TLB entries are invalidated together.
+     *  Default: 64. */
+    size_t evict_batch;
+    /** Max number of pages mapped per fault (fault-around). The window grows up to this size for sequential access
+     *  and shrinks to a single page for random access. Rounded down to a power of two, at most 512, 1 disables
+     *  fault-around. Default: 16. */
+    size_t fault_around_pages;
+    /** Non-zero: file-backed faults read through io_uring. Reads of many faults are in flight at once and each
+     *  page is mapped and woken as soon as its read completes. Falls back to synchronous reads if io_uring is
+     *  unavailable. Default: 0. */
+    int use_io_uring;
+    /** Non-zero: use io_uring with a kernel submission thread (IORING_SETUP_SQPOLL). The userfaultfd of file-backed
+     *  regions is then read through the same ring, so faults and file reads need no syscall. Default: 0. */
+    int io_uring_sqpoll;
+    /** Non-zero: file-backed regions read their file with O_DIRECT straight into the frames, bypassing the page
+     *  cache, so every resident page is cached once. The part of the last page behind EOF is zero-filled. Files
+     *  that do not support O_DIRECT (e.g. on tmpfs) are read buffered. Default: 0. */
+    int direct_io;
+    /** Submission queue entries per io_uring, one ring per handler thread. Default: 256. */
+    unsigned io_uring_depth;
+    /** Non-zero: the PTEditor backend builds all page tables of a region when it is mapped, so that faults only
+     *  write leaf entries and never walk the tables. Costs one 4KiB page-table page per 2MiB of the region whether
+     *  it is touched or not (2052KiB per GiB, about 0.2%). Regions without PROT_READ are built lazily. Default: 0. */
+    int eager_page_tables;
+    /** Non-zero: regions are also registered in userfaultfd write-protect mode and pages are mapped read-only. The
+     *  first write to a page is recorded in a per-region dirty bitmap before write access is granted, so ul_msync()
+     *  and ul_munmap() write back exactly the pages written since their last write-back, without scanning page
+     *  tables. Costs one fault per first write after each write-back. UL_BACKEND_PTEDIT and UL_BACKEND_UFFD_COPY
+     *  (Linux 5.7) only, regions of other backends are not tracked; blocks mapped huge keep using their dirty bit.
+     *  Default: 0. */
+    int wp_dirty_tracking;
+};
+
+/**
+ * \brief Initialize the engine with the given settings. Calling it is optional, the first ul_mmap initializes the
+ *        engine with default settings.
+ *
+ * \param config settings to use, NULL for defaults.
+ * \return 0 on success; -1 with errno set on failure, the engine is then left uninitialized: EBUSY if the engine is
+ *         already initialized, ENODEV if config->backend is not available (PTEditor without its kernel module,
+ *         UFFDIO_MOVE or minor faults on shmem on an older kernel), the errno of mlock() (e.g. ENOMEM or EPERM, see RLIMIT_MEMLOCK) if the page pool
+ *         of UL_BACKEND_PTEDIT can't be locked.
+ */
+int ul_init(const struct ul_config *config);
+
 /**
  * \brief Create a memory mapping. Currently, only two usages are supported:
- *        1. Anonymous memory mapping
+ *        1. Anonymous memory mapping: reads as zeros, a page read before it is written maps a shared zero page
+ *           and takes memory only on its first write
  *        2. File-backed memory mapping
  *
  * \param addr Specifies the starting address of the mapping area. Typically set to NULL, allowing to automatically choose a suitable address.
  * \param length The size of the file or device to be mapped (in bytes).
  * \param prot Specifies the access permissions of the mapped area, which can be a combination of PROT_READ, PROT_WRITE
  * \param flags Specifies the type and attributes of the mapping, which can be a combination of MAP_SHARED, MAP_PRIVATE, MAP_ANONYMOUS, etc.
+ *              MAP_HUGETLB maps the region with 2MiB pages, see ul_config.huge_pool_pages.
  * \param fd The file descriptor of the file or device to be mapped. If using MAP_ANONYMOUS, set it to -1.
  * \param offset The offset of the file or device, starting the mapping from this offset. It must be a multiple of the system page size.
  * \return On success, returns the starting address of the mapped area; on failure, returns MAP_FAILED (usually (void *)-1) and sets errno.
+ *         The first call initializes the engine, with the errors of ul_init().
  */
 void *ul_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 
+/**
+ * \brief Like ul_mmap(), with the backend of this region instead of ul_config.backend.
+ *        If the backend is not available (PTEditor without its kernel module, UFFDIO_MOVE on an older kernel),
+ *        returns MAP_FAILED with errno ENODEV; if it can't serve prot, with errno EINVAL.
+ */
+void *ul_mmap_backend(void *addr, size_t length, int prot, int flags, int fd, off_t offset, enum ul_backend backend);
+
 /**
  * \brief ul_munmap() deletes the mappings for the specified address range, and causes further references to addresses within the range to generate invalid memory references.  The  region is also automatically unmapped when the process is terminated. On the other hand, closing the file descriptor does not unmap the region.
  * Warnning: ul_munmap is not same with munmap, you must unmap all address range you get from ul_mmap.
  *
  * \param addr range start, Must be a multiple of the page size
  * \param length range length (must be the same as you gived in mmap)
+ * \return 0, or -1 with errno set: EINVAL if addr is not a region; EIO, ENOSPC and the like if writing dirty pages
+ *         back failed, the region is unmapped all the same and that data is lost.
  */
 int ul_munmap(void *addr, size_t length);
 
+/**
+ * \brief Write the dirty pages of a MAP_SHARED file-backed range back to its file, MS_SYNC also waits for the data to
+ *        reach the disk.
+ *
+ * \return 0, or -1 with errno set: EINVAL for an unaligned addr or bad flags, ENOMEM if the range is not mapped; EIO,
+ *         ENOSPC and the like if the write-back failed, the pages that were not written then stay dirty.
+ */
 int ul_msync(void *addr, size_t length, int flags);
+/**
+ * \brief Change the protection of a region. With UL_BACKEND_PTEDIT the VMA is left alone: the permission bits of the
+ *        resident pages are rewritten in one pass with a single TLB flush, and a write to a read-only region gets a
+ *        SIGSEGV from the fault handler.
+ *
+ * \param addr start of the region, the range must cover the whole region.
+ * \param prot PROT_READ, PROT_WRITE and PROT_EXEC. UL_BACKEND_PTEDIT needs PROT_READ and no MAP_HUGETLB, and
+ *        UL_BACKEND_UFFD_MOVE only serves PROT_READ | PROT_WRITE.
+ * \return 0, or -1 with errno set: EINVAL for a range or prot that can't be served, ENOMEM if the range is not mapped.
+ */
 int ul_mprotect(void *addr, size_t length, int prot);
+/**
+ * \brief Advise how a range of a region is going to be used.
+ *
+ * \param advice MADV_WILLNEED reads the missing pages of a readable file-backed region in the background, as far as
+ *        the page pool has free frames; regions using huge pages ignore it. MADV_DONTNEED drops
+ *        the resident pages, dirty pages of a MAP_SHARED file are written back first. MADV_SEQUENTIAL, MADV_RANDOM and
+ *        MADV_NORMAL set the fault-around window of the whole region to the maximum, one page or adaptive.
+ * \return 0, or -1 with errno set: EINVAL for an unaligned addr or an unknown advice, ENOMEM if the range is not mapped;
+ *         EIO, ENOSPC and the like if MADV_DONTNEED failed to write dirty pages back, they are dropped all the same.
+ */
 int ul_madvise(void *addr, size_t length, int advice);
+
+/** Buckets of ul_stats.fault_latency. */
+#define UL_LATENCY_BUCKETS 32
+
+/**
+ * \brief Counters of a region, or of all regions of the process.
+ */
+struct ul_stats {
+    /** Page faults resolved, several threads faulting on the same page at once count once. */
+    uint64_t faults;
+    /** Faults by reads, and by writes (including the first write to a page that was read before). */
+    uint64_t read_faults;
+    uint64_t write_faults;
+    /** Bytes read from the backing files, fault-around included. */
+    uint64_t bytes_read;
+    /** Pages mapped right now. */
+    uint64_t resident_pages;
+    /** Pages evicted to make room in the page pool. */
+    uint64_t evictions;
+    /** Dirty pages written back to the backing files, by eviction, ul_msync() and ul_munmap(). */
+    uint64_t write_backs;
+    /** Fault service time, from reading the fault to waking the faulting thread: fault_latency[i] counts the faults
+     *  that took [2^i, 2^(i+1)) nanoseconds, the last bucket all longer ones. */
+    uint64_t fault_latency[UL_LATENCY_BUCKETS];
+};
+
+/**
+ * \brief Get the counters of the region at addr, or the process-wide ones if addr is NULL. The process-wide
+ *        counters include regions unmapped since.
+ *
+ * \return 0 on success; -1 if addr is not within a region (errno is set to EINVAL).
+ */
+int ul_get_stats(void *addr, struct ul_stats *stats);
+
+/**
+ * \brief Upper bound in nanoseconds of the fault latency percentile p (0 < p <= 1) of stats, 0 without faults. A p
+ *        outside (0, 1] returns 0 with errno set to EINVAL.
+ */
+uint64_t ul_stats_latency_percentile(const struct ul_stats *stats, double p);
+
+/**
+ * \brief Print the process-wide counters and those of every region to out.
+ */
+void ul_dump_stats(FILE *out);
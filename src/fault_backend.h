@@ -0,0 +1,244 @@
+#pragma once
+#include <linux/userfaultfd.h>
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * How the fault handler turns filled frames into mappings.
+ *
+ * The engine decides which pages to populate and fills frames from the
+ * page pool; a backend installs them at the faulting addresses and gives
+ * access to the hardware state of the installed pages. Installing never
+ * wakes the faulting threads, the engine wakes whole runs at once.
+ *
+ * A backend either maps the frames themselves (maps_frames(): the frames
+ * stay owned by the region until unmapped, and their accessed/dirty bits
+ * drive eviction and write-back), or copies their content into pages the
+ * kernel allocates, so that the frames are free right after map_pages().
+ */
+class FaultBackend {
+   public:
+    // page_flags() bits
+    static constexpr unsigned PAGE_ACCESSED = 1;
+    static constexpr unsigned PAGE_DIRTY = 2;
+
+    virtual ~FaultBackend() = default;
+
+    virtual const char *name() const = 0;
+
+    virtual bool maps_frames() const = 0;
+
+    // UFFD_FEATURE_* the region's userfaultfd must be opened with
+    virtual uint64_t uffd_features() const { return 0; }
+
+    // whether regions with this protection and kind can be served
+    virtual bool supports_region(int prot, bool file_backed) const {
+        (void)prot;
+        (void)file_backed;
+        return true;
+    }
+
+    // UFFDIO_REGISTER_MODE_* of the region's range
+    virtual uint64_t register_mode() const {
+        return UFFDIO_REGISTER_MODE_MISSING;
+    }
+
+    /**
+     * Regions are shared mappings of a memfd instead of anonymous memory.
+     * The engine fills the region's pages through a second mapping of the
+     * memfd, the frames passed to map_pages() are these pages, and
+     * map_pages() maps the page cache pages behind them. A page may be
+     * mapped again (a minor fault, e.g. after a PTE was zapped).
+     */
+    virtual bool shmem_backed() const { return false; }
+
+    /**
+     * Prepare a new region, called right before its range is registered
+     * with the userfaultfd.
+     */
+    virtual void register_region(void *address, size_t length) {
+        (void)address;
+        (void)length;
+    }
+
+    /**
+     * Forget a region, called once no more of its faults are served and
+     * before its range is unmapped.
+     */
+    virtual void unregister_region(void *address, size_t length) {
+        (void)address;
+        (void)length;
+    }
+
+    /**
+     * The range every frame passed to map_pages() comes from, called once
+     * per page pool before any region is registered.
+     */
+    virtual void register_frames(void *address, size_t length) {
+        (void)address;
+        (void)length;
+    }
+
+    /**
+     * Map count filled frames at the not present pages starting at address,
+     * or over pages mapped by map_zero_readonly(). Backends that install the
+     * entries themselves give them the region's protection prot, the others
+     * get it from the kernel's VMA.
+     */
+    virtual void map_pages(long uffd, void *address, void *const *frames,
+                           size_t count, int prot) = 0;
+
+    /**
+     * Whether map_pages() can map at address without a fault there: backends
+     * that install the entries themselves need the kernel's PT page.
+     */
+    virtual bool can_map(void *address) {
+        (void)address;
+        return true;
+    }
+
+    /**
+     * Map count pages of zeros without using frames, false if the backend
+     * can't, the caller maps zeroed frames then.
+     */
+    virtual bool map_zero_pages(long uffd, void *address, size_t count) {
+        (void)uffd;
+        (void)address;
+        (void)count;
+        return false;
+    }
+
+    /**
+     * Map count pages of zeros for reading, without frames; false if the
+     * backend can't. With wp_zero_pages(), the first write to such a page
+     * is reported as a write-protect fault and the engine map_pages() a
+     * frame over it, otherwise the kernel gives the page a copy of its own.
+     */
+    virtual bool map_zero_readonly(long uffd, void *address, size_t count,
+                                   int prot) {
+        (void)prot;
+        return map_zero_pages(uffd, address, count);
+    }
+
+    virtual bool wp_zero_pages() const { return false; }
+
+    /**
+     * Accessed and dirty bits of a mapped page. A backend that can't see
+     * them reports every page as accessed and dirty.
+     */
+    virtual unsigned page_flags(void *address) = 0;
+
+    /**
+     * Clear the accessed bit of a mapped page, without a TLB flush.
+     */
+    virtual void clear_accessed(void *address) = 0;
+
+    /**
+     * Clear the dirty bit of a mapped page, returns whether it was set. The
+     * caller must flush_tlb() the page before it reads the content.
+     */
+    virtual bool test_and_clear_dirty(void *address) = 0;
+
+    /**
+     * Set the dirty bit of a mapped page again, after its write-back
+     * failed. Backends that report every page as dirty have nothing to do.
+     */
+    virtual void set_dirty(void *address) { (void)address; }
+
+    /**
+     * Unmap a page, returns the page_flags() it had. With keep_dirty, a
+     * dirty page stays mapped and -1 is returned. The caller must
+     * flush_tlb() the page before the frame's content is final.
+     */
+    virtual int unmap_page(void *address, bool keep_dirty) = 0;
+
+    /**
+     * Invalidate the TLB entries of n pages after their entries changed.
+     */
+    virtual void flush_tlb(void *const *addresses, size_t n) = 0;
+
+    /**
+     * Backends that maps_frames(): give n mapped pages protection prot (at
+     * least PROT_READ) in place, the caller must flush_tlb() them. Pages
+     * without PROT_WRITE are write-protected for the userfaultfd, so writes
+     * fault to the engine. The others leave this to the kernel's mprotect().
+     */
+    virtual void protect_pages(void *const *addresses, size_t n, int prot) {
+        (void)addresses;
+        (void)n;
+        (void)prot;
+    }
+
+    /**
+     * Dirty tracking (ul_config.wp_dirty_tracking): whether map_pages()
+     * without PROT_WRITE maps the pages write-protected for the userfaultfd,
+     * so that their first write is reported as a write-protect fault.
+     */
+    virtual bool supports_wp_tracking() const { return false; }
+
+    /**
+     * Dirty tracking: write-protect n mapped pages again (wp), or lift the
+     * write protection and give them the region's protection prot. The
+     * caller must flush_tlb() them.
+     */
+    virtual void write_protect(long uffd, void *const *addresses, size_t n,
+                               bool wp, int prot) {
+        (void)uffd;
+        protect_pages(addresses, n, wp ? prot & ~PROT_WRITE : prot);
+    }
+
+    /**
+     * Backends that don't maps_frames(): free the kernel's pages of a range
+     * whose pages were released, the next access faults again.
+     */
+    virtual void drop_pages(void *address, size_t length) {
+        (void)address;
+        (void)length;
+    }
+
+    /**
+     * Huge pages: map a physically contiguous 2MiB frame at the aligned
+     * address with one PMD entry of protection prot, like map_pages().
+     * map_huge_page() returns the entry it replaced, unmap_huge_page() puts
+     * it back (TLB flushed) and returns the page_flags() of the huge page.
+     */
+    virtual bool supports_huge() const { return false; }
+    virtual size_t map_huge_page(void *address, void *frame, int prot) = 0;
+    virtual unsigned unmap_huge_page(void *address, size_t old_entry) = 0;
+    virtual bool test_and_clear_huge_dirty(void *address) = 0;
+    virtual void set_huge_dirty(void *address) = 0;
+};
+
+/**
+ * Writes page table entries directly through PTEditor. Needs root and the
+ * PTEditor kernel module, returns nullptr if it is not available. With
+ * eager_page_tables, the page tables of a region are built when it is
+ * registered instead of by its faults.
+ */
+FaultBackend *create_ptedit_backend(bool eager_page_tables);
+
+/**
+ * Resolves faults with UFFDIO_COPY and UFFDIO_ZEROPAGE, works on any kernel
+ * with userfaultfd. Costs a copy per page, and the kernel's pages are not
+ * tracked: they are not evicted and every page counts as dirty, unless
+ * ul_config.wp_dirty_tracking write-protects them (Linux 5.7).
+ */
+FaultBackend *create_uffd_copy_backend();
+
+/**
+ * Resolves faults with UFFDIO_MOVE (Linux 6.8), which remaps the filled
+ * frame itself without copying it; tracked like create_uffd_copy_backend().
+ * Only serves PROT_READ | PROT_WRITE regions. lock_regions must tell
+ * whether the page pool is mlock()ed. Returns nullptr if the kernel lacks
+ * UFFDIO_MOVE.
+ */
+FaultBackend *create_uffd_move_backend(bool lock_regions);
+
+/**
+ * Serves anonymous regions backed by a memfd: pages are written to the
+ * page cache and mapped with UFFDIO_CONTINUE (minor faults, Linux 5.13).
+ * Returns nullptr if the kernel lacks minor faults on shmem.
+ */
+FaultBackend *create_uffd_minor_backend();
@@ -0,0 +1,147 @@
+#include "fault_handler_pool.h"
+
+#include <err.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+#include <numeric>
+
+// epoll_event.data.u64 of a shard's wake_fd, real sources start from 1
+static constexpr uint64_t WAKE_HANDLE = 0;
+static constexpr int MAX_EVENTS = 64;
+
+FaultHandlerPool::FaultHandlerPool(size_t num_workers) {
+    if (num_workers == 0) num_workers = 1;
+    shards_.resize(num_workers);
+
+    for (auto &shard : shards_) {
+        shard.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (shard.epoll_fd == -1) err(EXIT_FAILURE, "epoll_create1");
+
+        shard.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (shard.wake_fd == -1) err(EXIT_FAILURE, "eventfd");
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = WAKE_HANDLE;
+        if (epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, shard.wake_fd, &ev) == -1)
+            err(EXIT_FAILURE, "epoll_ctl");
+    }
+
+    for (size_t i = 0; i < shards_.size(); i++) {
+        shards_[i].thread = std::thread(&FaultHandlerPool::worker, this, i);
+    }
+}
+
+FaultHandlerPool::~FaultHandlerPool() {
+    stop_.store(true);
+    for (auto &shard : shards_) {
+        uint64_t one = 1;
+        if (write(shard.wake_fd, &one, sizeof(one)) != sizeof(one))
+            err(EXIT_FAILURE, "write-eventfd");
+    }
+    for (auto &shard : shards_) {
+        shard.thread.join();
+        close(shard.wake_fd);
+        close(shard.epoll_fd);
+    }
+}
+
+uint64_t FaultHandlerPool::add(int fd, Callback callback, int worker,
+                               size_t nr_workers) {
+    auto source = std::make_shared<Source>();
+    source->fd = fd;
+    source->callback = std::move(callback);
+
+    std::unique_lock<std::shared_mutex> guard(sources_mu_);
+    if (worker >= 0) {
+        source->shards.push_back(worker % shards_.size());
+    } else {
+        // pick the least loaded shards
+        std::vector<size_t> order(shards_.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return shards_[a].nr_sources < shards_[b].nr_sources;
+        });
+        nr_workers = std::min(std::max(nr_workers, (size_t)1), shards_.size());
+        source->shards.assign(order.begin(), order.begin() + nr_workers);
+    }
+
+    uint64_t handle = next_handle_++;
+    sources_[handle] = source;
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    // one event wakes one of the workers instead of all of them
+    if (source->shards.size() > 1) ev.events |= EPOLLEXCLUSIVE;
+    ev.data.u64 = handle;
+    for (size_t shard_idx : source->shards) {
+        shards_[shard_idx].nr_sources++;
+        if (epoll_ctl(shards_[shard_idx].epoll_fd, EPOLL_CTL_ADD, fd, &ev) ==
+            -1)
+            err(EXIT_FAILURE, "epoll_ctl-EPOLL_CTL_ADD");
+    }
+
+    return handle;
+}
+
+void FaultHandlerPool::remove(uint64_t handle) {
+    std::shared_ptr<Source> source;
+    {
+        std::unique_lock<std::shared_mutex> guard(sources_mu_);
+        auto it = sources_.find(handle);
+        if (it == sources_.end()) return;
+        source = std::move(it->second);
+        sources_.erase(it);
+
+        for (size_t shard_idx : source->shards) {
+            Shard &shard = shards_[shard_idx];
+            shard.nr_sources--;
+            if (epoll_ctl(shard.epoll_fd, EPOLL_CTL_DEL, source->fd,
+                          nullptr) == -1)
+                err(EXIT_FAILURE, "epoll_ctl-EPOLL_CTL_DEL");
+        }
+    }
+
+    // workers only take a reference under sources_mu_, so no new callback
+    // can start now; wait for the ones already running.
+    while (source->running.load(std::memory_order_acquire) != 0) {
+        std::this_thread::yield();
+    }
+}
+
+void FaultHandlerPool::worker(size_t shard_idx) {
+    Shard &shard = shards_[shard_idx];
+    struct epoll_event events[MAX_EVENTS];
+    std::shared_ptr<Source> ready[MAX_EVENTS];
+
+    while (!stop_.load(std::memory_order_relaxed)) {
+        int nready = epoll_wait(shard.epoll_fd, events, MAX_EVENTS, -1);
+        if (nready == -1) {
+            if (errno == EINTR) continue;
+            err(EXIT_FAILURE, "epoll_wait");
+        }
+
+        int nsources = 0;
+        {
+            std::shared_lock<std::shared_mutex> guard(sources_mu_);
+            for (int i = 0; i < nready; i++) {
+                if (events[i].data.u64 == WAKE_HANDLE) continue;
+                auto it = sources_.find(events[i].data.u64);
+                if (it == sources_.end()) continue;  // removed concurrently
+                it->second->running.fetch_add(1, std::memory_order_acquire);
+                ready[nsources++] = it->second;
+            }
+        }
+
+        for (int i = 0; i < nsources; i++) {
+            ready[i]->callback(shard_idx);
+            ready[i]->running.fetch_sub(1, std::memory_order_release);
+            ready[i].reset();
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Process-wide pool of fault handling threads.
+ *
+ * Every registered userfaultfd is multiplexed by epoll instead of being
+ * served by a dedicated thread. The pool is split into shards, each shard
+ * owns one epoll instance and one worker thread, and a new fd is assigned to
+ * the shard that currently serves the fewest fds. Idle regions cost nothing
+ * but an epoll registration.
+ *
+ * An fd may also be watched by several shards at once (EPOLLEXCLUSIVE): an
+ * event then wakes one idle worker, so while one worker is busy with the fd,
+ * the next event is picked up by another one.
+ */
+class FaultHandlerPool {
+   public:
+    // invoked on a worker thread whenever the registered fd is readable,
+    // with the index of that worker
+    using Callback = std::function<void(size_t worker)>;
+
+    explicit FaultHandlerPool(size_t num_workers);
+    ~FaultHandlerPool();
+
+    FaultHandlerPool(const FaultHandlerPool &) = delete;
+    FaultHandlerPool &operator=(const FaultHandlerPool &) = delete;
+
+    /**
+     * Start watching fd on the given worker, or with worker -1, on the
+     * nr_workers least loaded ones. Returns a handle for remove().
+     * With several workers, the callback runs concurrently.
+     */
+    uint64_t add(int fd, Callback callback, int worker = -1,
+                 size_t nr_workers = 1);
+
+    /**
+     * Stop watching the fd behind handle. When remove() returns, the
+     * callback is not running on any worker and will never run again.
+     */
+    void remove(uint64_t handle);
+
+    size_t num_workers() const { return shards_.size(); }
+
+   private:
+    struct Source {
+        int fd;
+        std::vector<size_t> shards;
+        Callback callback;
+        std::atomic<int> running{0};
+    };
+
+    struct Shard {
+        int epoll_fd = -1;
+        int wake_fd = -1;  // eventfd, only used to stop the worker
+        size_t nr_sources = 0;
+        std::thread thread;
+    };
+
+    void worker(size_t shard_idx);
+
+    std::vector<Shard> shards_;
+    std::atomic<bool> stop_{false};
+
+    std::shared_mutex sources_mu_;
+    uint64_t next_handle_ = 1;
+    std::unordered_map<uint64_t, std::shared_ptr<Source>> sources_;
+};
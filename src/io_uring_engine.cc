@@ -0,0 +1,178 @@
+#include "io_uring_engine.h"
+
+#include <err.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg,
+                             unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+IoUring::IoUring(unsigned entries, bool sqpoll) : sqpoll_(sqpoll) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 100;  // ms before the kernel thread sleeps
+    }
+
+    ring_fd_ = io_uring_setup(entries, &params);
+    if (ring_fd_ < 0) {
+        perror("io_uring_setup");
+        return;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) err(EXIT_FAILURE, "mmap-IORING_OFF_SQ_RING");
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring_ = sq_ring_;
+    } else {
+        cq_ring_ =
+            mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED)
+            err(EXIT_FAILURE, "mmap-IORING_OFF_CQ_RING");
+    }
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = (struct io_uring_sqe *)mmap(nullptr, sqes_size_,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, ring_fd_,
+                                        IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) err(EXIT_FAILURE, "mmap-IORING_OFF_SQES");
+
+    char *sq = (char *)sq_ring_;
+    sq_head_ = (unsigned *)(sq + params.sq_off.head);
+    sq_tail_ = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask_ = (unsigned *)(sq + params.sq_off.ring_mask);
+    sq_flags_ = (unsigned *)(sq + params.sq_off.flags);
+    sq_array_ = (unsigned *)(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    sq_local_tail_ = *sq_tail_;
+
+    char *cq = (char *)cq_ring_;
+    cq_head_ = (unsigned *)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask_ = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd_ == -1) err(EXIT_FAILURE, "eventfd");
+    if (io_uring_register(ring_fd_, IORING_REGISTER_EVENTFD, &event_fd_, 1) <
+        0)
+        err(EXIT_FAILURE, "io_uring_register-IORING_REGISTER_EVENTFD");
+}
+
+IoUring::~IoUring() {
+    if (ring_fd_ < 0) return;
+    munmap(sqes_, sqes_size_);
+    if (cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    munmap(sq_ring_, sq_ring_size_);
+    close(event_fd_);
+    close(ring_fd_);
+}
+
+struct io_uring_sqe *IoUring::get_sqe() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sq_local_tail_ - head >= sq_entries_) return nullptr;
+
+    unsigned idx = sq_local_tail_ & *sq_mask_;
+    sq_array_[idx] = idx;
+    sq_local_tail_++;
+
+    struct io_uring_sqe *sqe = &sqes_[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+bool IoUring::prep_readv(int fd, const struct iovec *iov, unsigned nr_iov,
+                         off_t offset, uint64_t user_data) {
+    std::lock_guard<std::mutex> guard(sq_mu_);
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)iov;
+    sqe->len = nr_iov;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool IoUring::prep_read(int fd, void *buf, unsigned len, off_t offset,
+                        uint64_t user_data) {
+    std::lock_guard<std::mutex> guard(sq_mu_);
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool IoUring::prep_cancel(uint64_t target_user_data, uint64_t user_data) {
+    std::lock_guard<std::mutex> guard(sq_mu_);
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target_user_data;
+    sqe->user_data = user_data;
+    return true;
+}
+
+void IoUring::submit() {
+    std::lock_guard<std::mutex> guard(sq_mu_);
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    // includes entries a previous io_uring_enter() left behind
+    unsigned to_submit =
+        sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (to_submit == 0) return;
+
+    unsigned flags = 0;
+    if (sqpoll_) {
+        // the kernel thread picks the entries up unless it sleeps
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!(__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) &
+              IORING_SQ_NEED_WAKEUP))
+            return;
+        flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+
+    while (io_uring_enter(ring_fd_, to_submit, 0, flags) < 0) {
+        if (errno == EINTR) continue;
+        // out of resources / CQ overflow: entries stay queued, retried by
+        // the next submit()
+        if (errno == EAGAIN || errno == EBUSY) return;
+        err(EXIT_FAILURE, "io_uring_enter");
+    }
+}
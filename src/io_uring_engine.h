@@ -0,0 +1,102 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Minimal io_uring wrapper on top of the raw syscalls (no liburing).
+ *
+ * Any thread may queue requests, submission is serialized by a mutex.
+ * Completions must be reaped by a single thread. Completion events are
+ * signalled on event_fd(), so the ring can sit in an epoll set next to the
+ * userfaultfds it serves.
+ *
+ * With sqpoll, a kernel thread consumes the submission queue and submit()
+ * only enters the kernel when that thread went to sleep.
+ */
+class IoUring {
+   public:
+    IoUring(unsigned entries, bool sqpoll);
+    ~IoUring();
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    /**
+     * Whether setup succeeded, the kernel may not support io_uring or
+     * forbid it (e.g. io_uring_disabled sysctl, seccomp).
+     */
+    bool ok() const { return ring_fd_ >= 0; }
+
+    int event_fd() const { return event_fd_; }
+
+    /**
+     * Queue a vectored read / a plain read / a cancellation of the request
+     * tagged user_data. Returns false if the submission queue is full.
+     * Nothing reaches the kernel before submit().
+     */
+    bool prep_readv(int fd, const struct iovec *iov, unsigned nr_iov,
+                    off_t offset, uint64_t user_data);
+    bool prep_read(int fd, void *buf, unsigned len, off_t offset,
+                   uint64_t user_data);
+    bool prep_cancel(uint64_t target_user_data, uint64_t user_data);
+
+    /**
+     * Hand all queued requests to the kernel.
+     */
+    void submit();
+
+    /**
+     * Call fn(user_data, res) for every available completion, returns the
+     * number of completions. Also consumes the event_fd() notification.
+     */
+    template <typename Fn>
+    unsigned reap(Fn &&fn);
+
+   private:
+    struct io_uring_sqe *get_sqe();
+
+    int ring_fd_ = -1;
+    int event_fd_ = -1;
+    bool sqpoll_ = false;
+
+    std::mutex sq_mu_;
+    void *sq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    void *cq_ring_ = nullptr;
+    size_t cq_ring_size_ = 0;
+    struct io_uring_sqe *sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_flags_, *sq_array_;
+    unsigned sq_local_tail_ = 0;  // tail including unsubmitted entries
+    unsigned sq_entries_ = 0;
+
+    unsigned *cq_head_, *cq_tail_, *cq_mask_;
+    struct io_uring_cqe *cqes_;
+};
+
+template <typename Fn>
+unsigned IoUring::reap(Fn &&fn) {
+    uint64_t events;
+    // only used as a wakeup, its counter value is irrelevant
+    (void)!read(event_fd_, &events, sizeof(events));
+
+    unsigned head = __atomic_load_n(cq_head_, __ATOMIC_RELAXED);
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned n = 0;
+    for (; head != tail; head++, n++) {
+        const struct io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+        uint64_t user_data = cqe.user_data;
+        int res = cqe.res;
+        // give the slot back before fn() may queue more requests
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        fn(user_data, res);
+    }
+    return n;
+}
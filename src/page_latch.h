@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+/**
+ * The latch word of a page of a ul_pool, vmcache style: the state in the high
+ * 8 bits (unlocked, a count of shared holders, or locked) and a version in the
+ * low 56 bits. Every exclusive unlatch increments the version, so an
+ * optimistic reader validates its reads by comparing versions.
+ *
+ * The engine's eviction takes a page's latch with try_lock_exclusive() and
+ * skips pages it can't take: a page latched by a fix stays resident.
+ */
+class PageLatch {
+   public:
+    static constexpr uint64_t UNLOCKED = 0;
+    static constexpr uint64_t MAX_SHARED = 252;
+    static constexpr uint64_t LOCKED = 253;
+
+    static uint64_t state(uint64_t word) { return word >> 56; }
+    static uint64_t version(uint64_t word) {
+        return word & ((1ull << 56) - 1);
+    }
+
+    bool try_lock_exclusive() {
+        uint64_t word = word_.load(std::memory_order_relaxed);
+        return state(word) == UNLOCKED &&
+               word_.compare_exchange_strong(word, (LOCKED << 56) | word,
+                                             std::memory_order_acquire);
+    }
+
+    void lock_exclusive() {
+        while (!try_lock_exclusive()) std::this_thread::yield();
+    }
+
+    void unlock_exclusive() {
+        uint64_t word = word_.load(std::memory_order_relaxed);
+        word_.store(version(word + 1), std::memory_order_release);
+    }
+
+    // unlock without a new version, the page was not modified
+    void unlock_unchanged() {
+        uint64_t word = word_.load(std::memory_order_relaxed);
+        word_.store(version(word), std::memory_order_release);
+    }
+
+    bool try_lock_shared() {
+        uint64_t word = word_.load(std::memory_order_relaxed);
+        uint64_t s = state(word);
+        return s < MAX_SHARED &&
+               word_.compare_exchange_strong(word, word + (1ull << 56),
+                                             std::memory_order_acquire);
+    }
+
+    void lock_shared() {
+        while (!try_lock_shared()) std::this_thread::yield();
+    }
+
+    void unlock_shared() {
+        word_.fetch_sub(1ull << 56, std::memory_order_release);
+    }
+
+    // waits for an exclusive holder, returns the version to validate()
+    uint64_t read_optimistic() const {
+        uint64_t word = word_.load(std::memory_order_acquire);
+        while (state(word) == LOCKED) {
+            std::this_thread::yield();
+            word = word_.load(std::memory_order_acquire);
+        }
+        return version(word);
+    }
+
+    // whether no exclusive holder changed the page since read_optimistic()
+    bool validate(uint64_t old_version) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t word = word_.load(std::memory_order_relaxed);
+        return state(word) != LOCKED && version(word) == old_version;
+    }
+
+   private:
+    std::atomic<uint64_t> word_{0};
+};
+
+/**
+ * Have the eviction of the ul_mmap() region at addr take the latch of each
+ * page, nullptr to stop. latches has one entry per page of the region.
+ * Returns -1 with errno set to EINVAL if addr is not the start of a region.
+ */
+int attach_page_latches(void *addr, PageLatch *latches);
@@ -1,48 +1,137 @@
+#pragma once
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <ctime>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <system_error>
 #include <thread>
 #include <vector>
 
-struct Page {
-    char head_padding[16];
-    std::atomic<Page*> next;
-    char data_padding[0];
-};
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static inline void zero_nt_avx2(void* dst,
+                                                                size_t size) {
+    __m256i zero = _mm256_setzero_si256();
+    for (char* p = (char*)dst; p < (char*)dst + size; p += 128) {
+        _mm256_stream_si256((__m256i*)p, zero);
+        _mm256_stream_si256((__m256i*)(p + 32), zero);
+        _mm256_stream_si256((__m256i*)(p + 64), zero);
+        _mm256_stream_si256((__m256i*)(p + 96), zero);
+    }
+}
+#endif
+
+/**
+ * Zero a page with non-temporal stores, which bypass the caches: a page
+ * zeroed ahead of time must not evict the working set from the LLC. size
+ * must be a multiple of 128. The stores are ordered by an sfence, the page
+ * may be published right after.
+ */
+static inline void zero_page_nt(void* dst, size_t size) {
+#if defined(__x86_64__)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) {
+        zero_nt_avx2(dst, size);
+    } else {
+        __m128i zero = _mm_setzero_si128();
+        for (char* p = (char*)dst; p < (char*)dst + size; p += 64) {
+            _mm_stream_si128((__m128i*)p, zero);
+            _mm_stream_si128((__m128i*)(p + 16), zero);
+            _mm_stream_si128((__m128i*)(p + 32), zero);
+            _mm_stream_si128((__m128i*)(p + 48), zero);
+        }
+    }
+    _mm_sfence();
+#else
+    memset(dst, 0, size);
+#endif
+}
 
+/**
+ * A fixed amount of physical pages, handed out by lock-free free lists.
+ *
+ * All pages come from one arena. With lock, it is populated and mlock()ed:
+ * pages the fault handler maps into regions behind the kernel's back must
+ * never be swapped out or freed while the pool lives. Without, the arena is
+ * populated by the first use of each page, for users that hand the pages
+ * back right after copying them. The pages are spread
+ * over num_pools free lists to reduce contention; allocate() pops from the
+ * list picked by the calling thread and falls back to the richest list.
+ *
+ * The free lists are linked through a side array indexed by page, so a free
+ * page is never written: it stays out of the caches, and free pages handed
+ * to the kernel (UFFDIO_MOVE) are not faulted back in.
+ *
+ * start_zeroing() keeps a separate list of zeroed pages filled from a
+ * background thread, for allocate_zeroed().
+ *
+ * With hugetlb, the arena comes from the reserved huge pages (vm.nr_hugepages)
+ * and page_size must be the default huge page size, every page is then
+ * physically contiguous. It is always populated, to take the reservation.
+ *
+ * Throws std::bad_alloc if the arena can't be mapped, and std::system_error
+ * with the errno of mlock() if it can't be locked.
+ */
 class MemoryPool {
    public:
     // default pool size = 1GiB = 262144 * 4096GiB
     // default page size = 4KiB
     MemoryPool(size_t num_pools = 8, size_t pagesPerPool = 262144,
-               size_t page_size = 4096)
-        : num_pools_(num_pools), page_size_(page_size) {
+               size_t page_size = 4096, bool hugetlb = false,
+               bool lock = true)
+        : num_pools_(num_pools),
+          page_size_(page_size),
+          capacity_(num_pools * pagesPerPool) {
+        assert((page_size & (page_size - 1)) == 0);
+        assert(capacity_ < UINT32_MAX);
         local_pools_.resize(num_pools);
         local_remain_pages_.resize(num_pools);
         pages_per_pool_.resize(num_pools, 0);
         for (size_t i = 0; i < num_pools; i++) {
-            local_pools_[i] = new std::atomic<Page*>();
+            local_pools_[i] = new std::atomic<uint64_t>(0);
             local_remain_pages_[i] = new std::atomic<size_t>(0);
         }
-        for (size_t pid = 0; pid < num_pools * pagesPerPool; pid++) {
-            Page* page =
-                static_cast<Page*>(std::aligned_alloc(page_size, page_size));
-            page->next.store(nullptr);
-            assert((size_t)page % page_size == 0);
-            if (page != nullptr) {
-                size_t pool_idx = ((size_t)page / page_size) % num_pools;
-                pages_per_pool_[pool_idx]++;
-                page->next.store(
-                    local_pools_[pool_idx]->load(std::memory_order_relaxed),
-                    std::memory_order_relaxed);
-                local_pools_[pool_idx]->store(page, std::memory_order_relaxed);
-                (*local_remain_pages_[pool_idx])++;
-            } else {
-                throw std::bad_alloc();
-            }
+        next_.reset(new std::atomic<uint32_t>[capacity_]);
+
+        arena_size_ = capacity_ * page_size;
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        if (lock || hugetlb) flags |= MAP_POPULATE;
+        if (hugetlb) flags |= MAP_HUGETLB;
+        arena_ = static_cast<char*>(mmap(nullptr, arena_size_,
+                                         PROT_READ | PROT_WRITE, flags, -1, 0));
+        if (arena_ == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        // THP collapse/split would move our pages under the hood
+        if (!hugetlb) madvise(arena_, arena_size_, MADV_NOHUGEPAGE);
+        if (lock && mlock(arena_, arena_size_) != 0) {
+            int error = errno;
+            munmap(arena_, arena_size_);
+            throw std::system_error(error, std::generic_category(),
+                                    "MemoryPool: mlock");
+        }
+        locked_ = lock;
+
+        for (size_t pid = 0; pid < capacity_; pid++) {
+            size_t pool_idx = pool_of(pid);
+            pages_per_pool_[pool_idx]++;
+            push(local_pools_[pool_idx], pid);
+            (*local_remain_pages_[pool_idx])++;
         }
 
         for (size_t i = 0; i < num_pools; ++i) {
@@ -51,32 +140,20 @@ class MemoryPool {
     }
 
     ~MemoryPool() {
-        size_t i = 0;
-        for (size_t i = 0; i < num_pools_; i++) {
-            assert(*local_remain_pages_[i] == pages_per_pool_[i]);
-        }
-
-        for (std::atomic<Page*>* localPool : local_pools_) {
-            Page* page = localPool->load(std::memory_order_seq_cst);
-            size_t free_cnt = 0;
-            while (page != nullptr) {
-                // printf("pool[%zu]: free page, cnt(%zu): %p\n", i, free_cnt,
-                // page);
-                free_cnt++;
-                Page* next = page->next.load(std::memory_order_seq_cst);
-                std::free(page);
-                page = next;
+        if (zero_thread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(zero_mu_);
+                zero_stop_ = true;
             }
-
-            // printf("actual free: %zu, expected free: %zu", free_cnt,
-            // local_remain_pages_[i]->load());
-            assert(free_cnt == local_remain_pages_[i]->load());
-            i++;
+            zero_cv_.notify_one();
+            zero_thread_.join();
         }
+        assert(free_pages() == capacity_);
         for (size_t i = 0; i < num_pools_; i++) {
             delete local_pools_[i];
             delete local_remain_pages_[i];
         }
+        munmap(arena_, arena_size_);
     }
 
     int get_rough_richest_pool() {
@@ -99,101 +176,223 @@ class MemoryPool {
         }
     }
 
+    /**
+     * Pop a free page, nullptr if the pool is exhausted.
+     */
     void* allocate() {
-        size_t pool_idx =
-            std::hash<std::thread::id>{}(std::this_thread::get_id()) %
-            num_pools_;
+        void* page = allocate_unzeroed();
+        if (page == nullptr) page = pop_zeroed();
+        return page;
+    }
 
-    retry:
-        Page *page = nullptr, *next = nullptr;
+    /**
+     * Pop a free page filled with zeros, nullptr if the pool is exhausted.
+     * Pages zeroed in the background are taken first.
+     */
+    void* allocate_zeroed() {
+        void* page = pop_zeroed();
+        if (page != nullptr) {
+            if (zeroed_pages_.load(std::memory_order_relaxed) <
+                zero_target_ / 2)
+                wake_zeroing();
+            return page;
+        }
+        // the thread may have gone idle on an exhausted pool
+        wake_zeroing();
+        page = allocate_unzeroed();
+        if (page != nullptr) memset(page, 0, page_size_);
+        return page;
+    }
 
-        do {
-            page = local_pools_[pool_idx]->load(std::memory_order_seq_cst);
-        } while (page != nullptr &&
-                 !local_pools_[pool_idx]->compare_exchange_weak(
-                     page, page->next.load(std::memory_order_seq_cst),
-                     std::memory_order_seq_cst));
-
-        // assert((size_t)page != 0x2a2a2a2a2a2a2a2a);  // in test, we write
-        // 0x2a to page
-        /*
-        while (page != nullptr &&
-               !local_pools_[richest_pool_idx]->compare_exchange_weak(
-                   page, page->next.load(std::memory_order_relaxed),
-                   std::memory_order_acquire, std::memory_order_relaxed))
-            ;
-            */
-
-        /*
-        while (page != nullptr && (size_t)page != 0x2a2a2a2a2a2a2a2a &&
-               !local_pools_[pool_idx]->compare_exchange_strong(
-                   page, next)) {
-            //page =
-        local_pools_[richest_pool_idx]->load(std::memory_order_seq_cst); next =
-        page->next.load(std::memory_order_seq_cst);
+    void deallocate(void* ptr) {
+        if (ptr == nullptr) {
+            return;
         }
-        */
+        assert(contains(ptr));
+
+        size_t pid = page_id(ptr);
+        size_t idx = pool_of(pid);
+        push(local_pools_[idx], pid);
+        (*local_remain_pages_[idx])++;
+        // a pool that ran dry left the zeroing thread idle
+        if (zero_idle_.load(std::memory_order_relaxed) &&
+            zeroed_pages_.load(std::memory_order_relaxed) < zero_target_)
+            wake_zeroing();
+    }
+
+    /**
+     * Start a background thread of the lowest priority (SCHED_IDLE) that
+     * zeroes free pages until target of them are zeroed, and refills them
+     * once allocate_zeroed() took half. A pool that runs dry stops it until
+     * pages are freed or allocate_zeroed() finds none zeroed.
+     */
+    void start_zeroing(size_t target) {
+        assert(!zero_thread_.joinable());
+        zero_target_ = std::min(target, capacity_);
+        if (zero_target_ == 0) return;
+        zero_thread_ = std::thread([this] { zero_loop(); });
+    }
+
+    bool contains(const void* ptr) const {
+        return ptr >= arena_ && ptr < arena_ + arena_size_;
+    }
+
+    size_t page_size() const { return page_size_; }
+
+    // the range all pages come from
+    void* arena() const { return arena_; }
+    size_t arena_size() const { return arena_size_; }
+
+    // whether the arena is mlock()ed
+    bool locked() const { return locked_; }
+
+    // total number of pages owned by the pool
+    size_t capacity() const { return capacity_; }
+
+    // number of free pages zeroed in the background
+    size_t zeroed_pages() const {
+        return zeroed_pages_.load(std::memory_order_relaxed);
+    }
 
-        (*local_remain_pages_[pool_idx])--;
+    // number of pages currently free, approximate while pages move
+    size_t free_pages() const {
+        return zeroed_pages_.load(std::memory_order_relaxed) + unzeroed_pages();
+    }
+
+   private:
+    size_t page_id(const void* page) const {
+        return ((const char*)page - arena_) / page_size_;
+    }
+
+    size_t pool_of(size_t pid) const {
+        return ((size_t)arena_ / page_size_ + pid) % num_pools_;
+    }
+
+    /*
+     * A list head holds the id + 1 of its first page (0: empty) in the low
+     * 32 bits and an ABA tag in the high ones. The tag changes on every
+     * push/pop, so a pop racing with pop+push of the same page fails its
+     * CAS.
+     */
+    static uint64_t make_head(uint64_t head, size_t pid_plus_one) {
+        return ((head >> 32) + 1) << 32 | pid_plus_one;
+    }
+
+    void push(std::atomic<uint64_t>* list, size_t pid) {
+        uint64_t head = list->load(std::memory_order_acquire);
+        do {
+            next_[pid].store((uint32_t)head, std::memory_order_relaxed);
+        } while (!list->compare_exchange_weak(head, make_head(head, pid + 1),
+                                              std::memory_order_release,
+                                              std::memory_order_acquire));
+    }
+
+    void* pop(std::atomic<uint64_t>* list) {
+        uint64_t head = list->load(std::memory_order_acquire);
+        uint32_t first;
+        do {
+            first = (uint32_t)head;
+            if (first == 0) return nullptr;
+            // a stale next_ entry if another thread popped first, the CAS
+            // below rejects it
+        } while (!list->compare_exchange_weak(
+            head,
+            make_head(head, next_[first - 1].load(std::memory_order_relaxed)),
+            std::memory_order_acquire, std::memory_order_acquire));
+        return arena_ + (size_t)(first - 1) * page_size_;
+    }
+
+    void* pop(size_t pool_idx) {
+        void* page = pop(local_pools_[pool_idx]);
+        if (page != nullptr) (*local_remain_pages_[pool_idx])--;
+        return page;
+    }
+
+    // a page from the free lists that are not zeroed
+    void* allocate_unzeroed() {
+        size_t pool_idx =
+            std::hash<std::thread::id>{}(std::this_thread::get_id()) %
+            num_pools_;
 
-        // printf("page: %p, next: %p\n", page, next);
-        // assert((size_t)page != 0x2a2a2a2a2a2a2a2a);
-        // assert((size_t)next != 0x2a2a2a2a2a2a2a2a);
-    end:
+        void* page = pop(pool_idx);
         if (page == nullptr) {
             int ret = get_rough_richest_pool();
-            if (ret != -1) {
-                pool_idx = ret;
-                goto retry;
-            }
+            if (ret != -1) page = pop(ret);
         }
-
         return page;
     }
 
-    void deallocate(void* ptr) {
-        size_t idx = (size_t)ptr / page_size_ % num_pools_;
+    // number of free pages that are not zeroed, approximate
+    size_t unzeroed_pages() const {
+        size_t free = 0;
+        for (size_t i = 0; i < num_pools_; i++) {
+            free += local_remain_pages_[i]->load(std::memory_order_relaxed);
+        }
+        return free;
+    }
 
-        if (ptr == nullptr) {
+    void* pop_zeroed() {
+        void* page = pop(&zeroed_list_);
+        if (page != nullptr) zeroed_pages_--;
+        return page;
+    }
+
+    // wake zero_thread_ if it is idle
+    void wake_zeroing() {
+        if (!zero_idle_.load(std::memory_order_relaxed) ||
+            !zero_idle_.exchange(false))
             return;
-        }
+        std::lock_guard<std::mutex> guard(zero_mu_);
+        zero_cv_.notify_one();
+    }
 
-        Page *page = nullptr, *expected = nullptr;
-        do {
-            page = static_cast<Page*>(ptr);
-            expected = local_pools_[idx]->load(std::memory_order_seq_cst);
-            page->next.store(expected, std::memory_order_seq_cst);
-        } while (!local_pools_[idx]->compare_exchange_weak(
-            expected, page, std::memory_order_seq_cst));
-        /*
-        while (!local_pools_[idx]->compare_exchange_weak(
-            expected, page, std::memory_order_acquire,
-            std::memory_order_relaxed))
-            ;
-            */
-
-        // assert((size_t)expected != 0x2a2a2a2a2a2a2a2a);
-        // assert((size_t)(page->next.load()) != 0x2a2a2a2a2a2a2a2a);
-
-        /*
-        while (!local_pools_[idx]->compare_exchange_strong(expected, page)) {
-            page->next.store(expected, std::memory_order_seq_cst);
-            //assert((size_t)expected != 0x2a2a2a2a2a2a2a2a);
-            //assert((size_t)(page->next.load()) != 0x2a2a2a2a2a2a2a2a);
-        }
-        */
+    void zero_loop() {
+        // only run on otherwise idle CPUs
+        struct sched_param param = {};
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
 
-        // assert((size_t)(local_pools_[idx]->load(std::memory_order_seq_cst))!=
-        // 0x2a2a2a2a2a2a2a2a);
-        // assert((size_t)(local_pools_[idx]->load(std::memory_order_seq_cst)->next.load())
-        // != 0x2a2a2a2a2a2a2a2a); printf("dealloc page %p\n", ptr);
-        (*local_remain_pages_[idx])++;
+        std::unique_lock<std::mutex> lock(zero_mu_);
+        while (!zero_stop_) {
+            lock.unlock();
+            while (zeroed_pages_.load(std::memory_order_relaxed) <
+                   zero_target_) {
+                void* page = allocate_unzeroed();
+                if (page == nullptr) break;
+                zero_page_nt(page, page_size_);
+                push(&zeroed_list_, page_id(page));
+                zeroed_pages_++;
+            }
+            lock.lock();
+            zero_idle_ = true;
+            // a page freed before zero_idle_ was set found the thread busy
+            if (zeroed_pages_.load(std::memory_order_relaxed) < zero_target_ &&
+                unzeroed_pages() > 0) {
+                zero_idle_ = false;
+                continue;
+            }
+            zero_cv_.wait(lock, [this] { return zero_stop_ || !zero_idle_; });
+        }
     }
 
-   private:
     size_t num_pools_;
     size_t page_size_;
+    size_t capacity_;
+    char* arena_ = nullptr;
+    size_t arena_size_ = 0;
+    bool locked_ = false;
     std::vector<size_t> pages_per_pool_;
-    std::vector<std::atomic<Page*>*> local_pools_;
+    std::vector<std::atomic<uint64_t>*> local_pools_;
     std::vector<std::atomic<size_t>*> local_remain_pages_;
+    // next page id + 1 of each free page in its list
+    std::unique_ptr<std::atomic<uint32_t>[]> next_;
+
+    // pages zeroed by zero_thread_
+    std::atomic<uint64_t> zeroed_list_{0};
+    std::atomic<size_t> zeroed_pages_{0};
+    size_t zero_target_ = 0;
+    std::thread zero_thread_;
+    std::mutex zero_mu_;
+    std::condition_variable zero_cv_;
+    bool zero_stop_ = false;
+    std::atomic<bool> zero_idle_{false};
 };
@@ -0,0 +1,408 @@
+#include "fault_backend.h"
+
+#include <err.h>
+#include <ptedit_header.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+
+// entries per page table level
+static constexpr size_t PT_ENTRIES = 512;
+// software bit the kernel uses as the userfaultfd write-protect marker
+static constexpr int PAGE_BIT_UFFD_WP = PTEDIT_PAGE_BIT_SOFTW2;
+
+// Linux 5.14, older headers lack it
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+/**
+ * Edits the page tables of our own process through PTEditor's mapping of
+ * physical memory. Pages are installed behind the kernel's back, the frames
+ * must therefore stay pinned (the page pool mlock()s them) and every entry
+ * must be cleared again before the kernel tears the range down.
+ *
+ * A page table walk through PTEditor costs a read per level. The PT page
+ * behind each 2MiB slot of a region or of the frame pool is therefore
+ * looked up once and remembered: after that, mapping a page is a load of
+ * the frame's PTE and a store to the region's. With eager_page_tables, all
+ * PT pages of a region are built and looked up when it is registered.
+ */
+class PteditBackend final : public FaultBackend {
+   public:
+    explicit PteditBackend(bool eager_page_tables)
+        : page_size_(sysconf(_SC_PAGE_SIZE)),
+          eager_page_tables_(eager_page_tables) {
+        // the frame behind every zero page, pinned like the pool
+        zero_page_ = mmap(nullptr, page_size_, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (zero_page_ == MAP_FAILED) err(EXIT_FAILURE, "mmap");
+        if (mlock(zero_page_, page_size_) != 0) err(EXIT_FAILURE, "mlock");
+        zero_pfn_ = ptedit_pte_get_pfn(zero_page_, 0);
+    }
+
+    ~PteditBackend() override {
+        munmap(zero_page_, page_size_);
+        ptedit_cleanup();
+    }
+
+    const char *name() const override { return "ptedit"; }
+
+    bool maps_frames() const override { return true; }
+
+    // writes to pages ul_mprotect() made read-only fault to the engine,
+    // which signals the writing thread
+    uint64_t uffd_features() const override { return UFFD_FEATURE_THREAD_ID; }
+
+    // read-only entries are write-protected for the userfaultfd already
+    bool supports_wp_tracking() const override { return true; }
+
+    void register_region(void *address, size_t length) override {
+        add_window(address, length);
+        if (eager_page_tables_) build_page_tables(address, length);
+    }
+
+    void unregister_region(void *address, size_t length) override {
+        // the kernel may free the PT pages with the range
+        std::unique_lock<std::shared_mutex> guard(windows_mu_);
+        windows_.erase((size_t)address);
+        windows_gen_.fetch_add(1, std::memory_order_release);
+        (void)length;
+    }
+
+    void register_frames(void *address, size_t length) override {
+        add_window(address, length);
+    }
+
+    /*
+     * ptedit_update() walks the page table a second time and invalidates
+     * the TLB through an ioctl, twice. Neither is needed here: the kernel
+     * allocated the PT page before it reported the fault, and x86 never
+     * caches non-present translations, so a plain store through PTEditor's
+     * physical memory mapping is enough.
+     */
+    void map_pages(long, void *address, void *const *frames, size_t count,
+                   int prot) override {
+        size_t bits = prot_bits(prot);
+        // page content must be visible before the translation is
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < count; i++) {
+            void *page = (char *)address + i * page_size_;
+            size_t pfn = ptedit_get_pfn(
+                __atomic_load_n(pte_slot(frames[i]), __ATOMIC_RELAXED));
+            size_t pte = ptedit_set_pfn(0, pfn);
+            pte = ptedit_pte_entry_set_bit(pte, PTEDIT_PAGE_BIT_PRESENT);
+            pte = ptedit_pte_entry_set_bit(pte, PTEDIT_PAGE_BIT_USER);
+            __atomic_store_n(pte_slot(page), pte | bits, __ATOMIC_RELAXED);
+        }
+    }
+
+    // the PT page was built at registration, or by a fault since
+    bool can_map(void *address) override {
+        std::atomic<size_t *> *cached = cached_pt_page(address);
+        if (cached != nullptr &&
+            cached->load(std::memory_order_relaxed) != nullptr)
+            return true;
+        return ptedit_resolve(address, 0).valid & PTEDIT_VALID_MASK_PTE;
+    }
+
+    /*
+     * Read-only entries of the zero frame, marked write-protected for the
+     * userfaultfd: a write then faults to us, where the kernel would copy
+     * a page it does not own.
+     */
+    bool map_zero_readonly(long, void *address, size_t count,
+                           int prot) override {
+        size_t pte = ptedit_set_pfn(0, zero_pfn_);
+        pte = ptedit_pte_entry_set_bit(pte, PTEDIT_PAGE_BIT_PRESENT);
+        pte = ptedit_pte_entry_set_bit(pte, PTEDIT_PAGE_BIT_USER);
+        pte |= prot_bits(prot & ~PROT_WRITE);
+        for (size_t i = 0; i < count; i++) {
+            void *page = (char *)address + i * page_size_;
+            __atomic_store_n(pte_slot(page), pte, __ATOMIC_RELAXED);
+        }
+        return true;
+    }
+
+    bool wp_zero_pages() const override { return true; }
+
+    unsigned page_flags(void *address) override {
+        return flags_of(__atomic_load_n(pte_slot(address), __ATOMIC_RELAXED));
+    }
+
+    void clear_accessed(void *address) override {
+        // no TLB flush, a stale entry only delays the next access bit
+        __atomic_fetch_and(pte_slot(address),
+                           ~(1ull << PTEDIT_PAGE_BIT_ACCESSED),
+                           __ATOMIC_RELAXED);
+    }
+
+    bool test_and_clear_dirty(void *address) override {
+        size_t old =
+            __atomic_fetch_and(pte_slot(address),
+                               ~(1ull << PTEDIT_PAGE_BIT_DIRTY), __ATOMIC_SEQ_CST);
+        return old & (1ull << PTEDIT_PAGE_BIT_DIRTY);
+    }
+
+    void set_dirty(void *address) override {
+        __atomic_fetch_or(pte_slot(address), 1ull << PTEDIT_PAGE_BIT_DIRTY,
+                          __ATOMIC_SEQ_CST);
+    }
+
+    int unmap_page(void *address, bool keep_dirty) override {
+        size_t *pte = pte_slot(address);
+        if (keep_dirty &&
+            (__atomic_load_n(pte, __ATOMIC_RELAXED) &
+             (1ull << PTEDIT_PAGE_BIT_DIRTY)))
+            return -1;
+        // atomically, the CPU may set the dirty bit until we took the entry
+        size_t entry = __atomic_exchange_n(pte, 0, __ATOMIC_SEQ_CST);
+        if (keep_dirty && (entry & (1ull << PTEDIT_PAGE_BIT_DIRTY))) {
+            // written since the check, put it back
+            __atomic_store_n(pte, entry, __ATOMIC_RELAXED);
+            return -1;
+        }
+        return flags_of(entry);
+    }
+
+    void flush_tlb(void *const *addresses, size_t n) override {
+        // one shootdown for the whole batch
+        ptedit_invalidate_tlb_batch(addresses, n);
+    }
+
+    /*
+     * Only the permission bits change: the entries are rewritten in place
+     * with a compare-and-swap each, keeping the accessed and dirty bits the
+     * CPU sets meanwhile. Entries that were unmapped since stay empty.
+     */
+    void protect_pages(void *const *addresses, size_t n, int prot) override {
+        const size_t mask = (1ull << PTEDIT_PAGE_BIT_RW) |
+                            (1ull << PAGE_BIT_UFFD_WP) |
+                            (1ull << PTEDIT_PAGE_BIT_NX);
+        size_t bits = prot_bits(prot);
+        for (size_t i = 0; i < n; i++) {
+            size_t *pte = pte_slot(addresses[i]);
+            size_t entry = __atomic_load_n(pte, __ATOMIC_RELAXED);
+            while ((entry & (1ull << PTEDIT_PAGE_BIT_PRESENT)) &&
+                   !__atomic_compare_exchange_n(pte, &entry,
+                                                (entry & ~mask) | bits, false,
+                                                __ATOMIC_SEQ_CST,
+                                                __ATOMIC_RELAXED)) {
+            }
+        }
+    }
+
+    bool supports_huge() const override { return true; }
+
+    size_t map_huge_page(void *address, void *frame, int prot) override {
+        ptedit_entry_t vm = ptedit_resolve(address, 0);
+        assert(vm.valid & PTEDIT_VALID_MASK_PMD);
+        size_t old_entry = vm.pmd;
+
+        size_t pmd =
+            ptedit_set_pfn(0, ptedit_get_pfn(ptedit_resolve(frame, 0).pmd));
+        pmd = ptedit_pte_entry_set_bit(pmd, PTEDIT_PAGE_BIT_PRESENT);
+        pmd |= prot_bits(prot);
+        pmd = ptedit_pte_entry_set_bit(pmd, PTEDIT_PAGE_BIT_USER);
+        pmd = ptedit_pte_entry_set_bit(pmd, PTEDIT_PAGE_BIT_PSE);
+        // the slot has no PT page until unmap_huge_page() puts it back
+        forget_pt_page(address);
+        vm.pmd = pmd;
+        vm.valid = PTEDIT_VALID_MASK_PMD;
+        // the page content must be visible before the translation is
+        std::atomic_thread_fence(std::memory_order_release);
+        ptedit_update(address, 0, &vm);
+        return old_entry;
+    }
+
+    unsigned unmap_huge_page(void *address, size_t old_entry) override {
+        ptedit_entry_t vm = ptedit_resolve(address, 0);
+        unsigned flags = flags_of(vm.pmd);
+        vm.pmd = old_entry;
+        vm.valid = PTEDIT_VALID_MASK_PMD;
+        ptedit_update(address, 0, &vm);
+        // bits the CPU set until the flush
+        flags |= flags_of(ptedit_resolve(address, 0).pmd);
+        return flags;
+    }
+
+    bool test_and_clear_huge_dirty(void *address) override {
+        size_t old =
+            __atomic_fetch_and(pmd_slot(address),
+                               ~(1ull << PTEDIT_PAGE_BIT_DIRTY), __ATOMIC_SEQ_CST);
+        return old & (1ull << PTEDIT_PAGE_BIT_DIRTY);
+    }
+
+    void set_huge_dirty(void *address) override {
+        __atomic_fetch_or(pmd_slot(address), 1ull << PTEDIT_PAGE_BIT_DIRTY,
+                          __ATOMIC_SEQ_CST);
+    }
+
+   private:
+    /*
+     * Permission bits of a PTE with protection prot. A read-only entry is
+     * marked write-protected for the userfaultfd: the kernel would otherwise
+     * handle the write to a frame it does not own itself.
+     */
+    static size_t prot_bits(int prot) {
+        size_t bits = 0;
+        if (prot & PROT_WRITE) {
+            bits = ptedit_pte_entry_set_bit(bits, PTEDIT_PAGE_BIT_RW);
+        } else {
+            bits = ptedit_pte_entry_set_bit(bits, PAGE_BIT_UFFD_WP);
+        }
+        if (!(prot & PROT_EXEC))
+            bits = ptedit_pte_entry_set_bit(bits, PTEDIT_PAGE_BIT_NX);
+        return bits;
+    }
+
+    static unsigned flags_of(size_t entry) {
+        unsigned flags = 0;
+        if (entry & (1ull << PTEDIT_PAGE_BIT_ACCESSED)) flags |= PAGE_ACCESSED;
+        if (entry & (1ull << PTEDIT_PAGE_BIT_DIRTY)) flags |= PAGE_DIRTY;
+        return flags;
+    }
+
+    /*
+     * The leaf PTE of address in PTEditor's mapping of physical memory, the
+     * PT page must exist. The CPU updates the accessed and dirty bits of a
+     * present PTE concurrently, so modify it with atomics only.
+     */
+    size_t *pte_slot(void *address) {
+        return pt_page(address) + (size_t)address / page_size_ % PT_ENTRIES;
+    }
+
+    /*
+     * PT pages of the 2MiB slots of a registered range, nullptr until a
+     * slot is first used. The kernel keeps a PT page until the range is
+     * unmapped; unmap_huge_page() puts the same page back.
+     */
+    struct Window {
+        size_t start;
+        size_t end;
+        size_t first_slot;
+        std::unique_ptr<std::atomic<size_t *>[]> pt_pages;
+    };
+
+    size_t slot_of(void *address) const {
+        return (size_t)address / (page_size_ * PT_ENTRIES);
+    }
+
+    void add_window(void *address, size_t length) {
+        size_t first = slot_of(address);
+        size_t slots = slot_of((char *)address + length - 1) - first + 1;
+        std::unique_ptr<Window> window(new Window{
+            (size_t)address, (size_t)address + length, first,
+            std::unique_ptr<std::atomic<size_t *>[]>(
+                new std::atomic<size_t *>[slots]())});
+        std::unique_lock<std::shared_mutex> guard(windows_mu_);
+        windows_[(size_t)address] = std::move(window);
+    }
+
+    // the PT page cache entry of address, nullptr outside of all windows
+    std::atomic<size_t *> *cached_pt_page(void *address) {
+        size_t addr = (size_t)address;
+        /*
+         * Most lookups hit the window of the thread's last one. Its bounds
+         * are copied: a window may be freed once its range is no longer
+         * served, only the generation tells that it is gone.
+         */
+        struct LastWindow {
+            size_t start, end, first_slot;
+            std::atomic<size_t *> *pt_pages;
+        };
+        thread_local LastWindow last = {0, 0, 0, nullptr};
+        thread_local uint64_t last_gen = 0;
+        uint64_t gen = windows_gen_.load(std::memory_order_acquire);
+        if (last_gen != gen || addr < last.start || addr >= last.end) {
+            std::shared_lock<std::shared_mutex> guard(windows_mu_);
+            auto it = windows_.upper_bound(addr);
+            if (it == windows_.begin() || addr >= std::prev(it)->second->end)
+                return nullptr;
+            const Window &window = *std::prev(it)->second;
+            last = {window.start, window.end, window.first_slot,
+                    window.pt_pages.get()};
+            last_gen = gen;
+        }
+        return &last.pt_pages[slot_of(address) - last.first_slot];
+    }
+
+    size_t *pt_page(void *address) {
+        std::atomic<size_t *> *cached = cached_pt_page(address);
+        if (cached != nullptr) {
+            size_t *pt = cached->load(std::memory_order_relaxed);
+            if (pt != nullptr) return pt;
+        }
+        ptedit_entry_t vm = ptedit_resolve(address, 0);
+        assert(vm.valid & PTEDIT_VALID_MASK_PTE);
+        size_t *pt =
+            (size_t *)(ptedit_vmem + ptedit_get_pfn(vm.pmd) * page_size_);
+        if (cached != nullptr) cached->store(pt, std::memory_order_relaxed);
+        return pt;
+    }
+
+    /*
+     * Have the kernel build the page tables of the range by mapping its zero
+     * page everywhere, then clear the entries behind its back: the zero page
+     * is not counted in any mapping, and the range is not registered with the
+     * userfaultfd yet. The PT pages stay until the range is unmapped.
+     */
+    void build_page_tables(void *address, size_t length) {
+        // e.g. PROT_NONE, the faults build the tables then
+        if (madvise(address, length, MADV_POPULATE_READ) == -1) return;
+        void *addresses[PT_ENTRIES];
+        size_t end = (size_t)address + length;
+        for (size_t addr = (size_t)address; addr < end;) {
+            size_t slot_end = (slot_of((void *)addr) + 1) * page_size_ *
+                              PT_ENTRIES;
+            size_t *pt = pt_page((void *)addr);
+            size_t n = 0;
+            for (; addr < std::min(end, slot_end); addr += page_size_) {
+                __atomic_store_n(&pt[addr / page_size_ % PT_ENTRIES], 0,
+                                 __ATOMIC_RELAXED);
+                addresses[n++] = (void *)addr;
+            }
+            ptedit_invalidate_tlb_batch(addresses, n);
+        }
+    }
+
+    void forget_pt_page(void *address) {
+        std::atomic<size_t *> *cached = cached_pt_page(address);
+        if (cached != nullptr) cached->store(nullptr, std::memory_order_relaxed);
+    }
+
+    // the PMD entry of address, like pte_slot()
+    size_t *pmd_slot(void *address) const {
+        ptedit_entry_t vm = ptedit_resolve(address, 0);
+        assert(vm.valid & PTEDIT_VALID_MASK_PMD);
+        return (size_t *)(ptedit_vmem + ptedit_get_pfn(vm.pud) * page_size_ +
+                          ((size_t)address / (page_size_ * PT_ENTRIES) %
+                           PT_ENTRIES) *
+                              sizeof(size_t));
+    }
+
+    size_t page_size_;
+    bool eager_page_tables_;
+    void *zero_page_;
+    size_t zero_pfn_;
+
+    // PT page caches by first slot; windows_gen_ counts removals, which
+    // invalidate the threads' last lookups
+    std::shared_mutex windows_mu_;
+    std::map<size_t, std::unique_ptr<Window>> windows_;
+    std::atomic<uint64_t> windows_gen_{0};
+};
+
+FaultBackend *create_ptedit_backend(bool eager_page_tables) {
+    if (ptedit_init()) return nullptr;
+    ptedit_use_implementation(PTEDIT_IMPL_USER);
+    return new PteditBackend(eager_page_tables);
+}
@@ -0,0 +1,292 @@
+#include "fault_backend.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+
+// UFFDIO_MOVE is Linux 6.8, older headers lack it
+#ifndef UFFDIO_MOVE
+#define UFFD_FEATURE_MOVE (1 << 16)
+#define _UFFDIO_MOVE (0x05)
+struct uffdio_move {
+    __u64 dst;
+    __u64 src;
+    __u64 len;
+#define UFFDIO_MOVE_MODE_DONTWAKE ((__u64)1 << 0)
+#define UFFDIO_MOVE_MODE_ALLOW_SRC_HOLES ((__u64)1 << 1)
+    __u64 mode;
+    __s64 move;
+};
+#define UFFDIO_MOVE _IOWR(UFFDIO, _UFFDIO_MOVE, struct uffdio_move)
+#endif
+
+// Linux 5.18, MADV_DONTNEED fails on mlock()ed ranges
+#ifndef MADV_DONTNEED_LOCKED
+#define MADV_DONTNEED_LOCKED 24
+#endif
+
+/**
+ * Resolves faults through the userfaultfd ioctls, without any privilege.
+ * UFFDIO_COPY allocates a page in the kernel and copies the frame into it;
+ * the frame can be reused right away. Pages of zeros are mapped with
+ * UFFDIO_ZEROPAGE, which maps the shared zero page until the first write.
+ */
+class UffdCopyBackend : public FaultBackend {
+   public:
+    explicit UffdCopyBackend(bool wp_tracking = false)
+        : page_size_(sysconf(_SC_PAGE_SIZE)), wp_tracking_(wp_tracking) {}
+
+    const char *name() const override { return "uffd-copy"; }
+
+    bool maps_frames() const override { return false; }
+
+    // the kernel's VMA protects the pages, the engine only asks for write
+    // protection with dirty tracking
+    void map_pages(long uffd, void *address, void *const *frames,
+                   size_t count, int prot) override {
+        for (size_t i = 0; i < count; i++) {
+            struct uffdio_copy copy;
+            copy.dst = (unsigned long)address + i * page_size_;
+            copy.src = (unsigned long)frames[i];
+            copy.len = page_size_;
+            copy.mode = UFFDIO_COPY_MODE_DONTWAKE;
+            if (!(prot & PROT_WRITE)) copy.mode |= UFFDIO_COPY_MODE_WP;
+            copy.copy = 0;
+            // EAGAIN: the address space changed under us, retry
+            while (ioctl(uffd, UFFDIO_COPY, &copy) == -1) {
+                // EEXIST: mapped already, the engine repaired a page that
+                // was not gone after all, keep it
+                if (errno == EEXIST) break;
+                if (errno != EAGAIN) err(EXIT_FAILURE, "ioctl-UFFDIO_COPY");
+                copy.copy = 0;
+            }
+        }
+    }
+
+    bool map_zero_pages(long uffd, void *address, size_t count) override {
+        struct uffdio_zeropage zeropage;
+        zeropage.range.start = (unsigned long)address;
+        zeropage.range.len = count * page_size_;
+        zeropage.mode = UFFDIO_ZEROPAGE_MODE_DONTWAKE;
+        zeropage.zeropage = 0;
+        while (ioctl(uffd, UFFDIO_ZEROPAGE, &zeropage) == -1) {
+            // EEXIST: the page is mapped already, skip it
+            if (errno != EAGAIN && errno != EEXIST)
+                err(EXIT_FAILURE, "ioctl-UFFDIO_ZEROPAGE");
+            // a partial zeropage reports the bytes done
+            size_t done = zeropage.zeropage > 0 ? zeropage.zeropage : 0;
+            if (errno == EEXIST) done += page_size_;
+            if (done >= zeropage.range.len) break;
+            zeropage.range.start += done;
+            zeropage.range.len -= done;
+            zeropage.zeropage = 0;
+        }
+        return true;
+    }
+
+    // the page tables are the kernel's, assume the worst
+    unsigned page_flags(void *) override { return PAGE_ACCESSED | PAGE_DIRTY; }
+
+    void clear_accessed(void *) override {}
+
+    bool test_and_clear_dirty(void *) override { return true; }
+
+    int unmap_page(void *address, bool keep_dirty) override {
+        if (keep_dirty) return -1;
+        // the kernel frees the page, the next access faults again
+        if (madvise(address, page_size_, MADV_DONTNEED) == -1)
+            err(EXIT_FAILURE, "madvise-MADV_DONTNEED");
+        return PAGE_ACCESSED | PAGE_DIRTY;
+    }
+
+    // the kernel invalidates whatever it changed
+    void flush_tlb(void *const *, size_t) override {}
+
+    bool supports_wp_tracking() const override { return wp_tracking_; }
+
+    // one UFFDIO_WRITEPROTECT per run of adjacent pages
+    void write_protect(long uffd, void *const *addresses, size_t n, bool wp,
+                       int) override {
+        for (size_t i = 0; i < n;) {
+            size_t j = i + 1;
+            while (j < n &&
+                   addresses[j] == (char *)addresses[i] + (j - i) * page_size_)
+                j++;
+            struct uffdio_writeprotect writeprotect;
+            writeprotect.range.start = (unsigned long)addresses[i];
+            writeprotect.range.len = (j - i) * page_size_;
+            // protecting never wakes, and must not be told so
+            writeprotect.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP
+                                   : UFFDIO_WRITEPROTECT_MODE_DONTWAKE;
+            while (ioctl(uffd, UFFDIO_WRITEPROTECT, &writeprotect) == -1) {
+                if (errno != EAGAIN)
+                    err(EXIT_FAILURE, "ioctl-UFFDIO_WRITEPROTECT");
+            }
+            i = j;
+        }
+    }
+
+    void drop_pages(void *address, size_t length) override {
+        if (madvise(address, length, MADV_DONTNEED) == -1)
+            err(EXIT_FAILURE, "madvise-MADV_DONTNEED");
+    }
+
+    size_t map_huge_page(void *, void *, int) override { abort(); }
+    unsigned unmap_huge_page(void *, size_t) override { abort(); }
+    bool test_and_clear_huge_dirty(void *) override { abort(); }
+    void set_huge_dirty(void *) override { abort(); }
+
+   protected:
+    size_t page_size_;
+
+   private:
+    bool wp_tracking_;
+};
+
+/**
+ * Like UffdCopyBackend, but UFFDIO_MOVE takes the filled frame itself out
+ * of the pool and remaps it at the faulting address, no copy. The pool is
+ * left with a hole that the next write to the frame fills with a new page.
+ *
+ * The kernel only moves between VMAs with the same access flags and the
+ * same mlock state: regions must be PROT_READ | PROT_WRITE like the pool,
+ * and are locked on fault if the pool is locked.
+ */
+class UffdMoveBackend final : public UffdCopyBackend {
+   public:
+    explicit UffdMoveBackend(bool lock_regions) : lock_regions_(lock_regions) {}
+
+    const char *name() const override { return "uffd-move"; }
+
+    uint64_t uffd_features() const override { return UFFD_FEATURE_MOVE; }
+
+    bool supports_region(int prot, bool) const override {
+        return prot == (PROT_READ | PROT_WRITE);
+    }
+
+    void register_region(void *address, size_t length) override {
+        // MLOCK_ONFAULT: mlock() would populate the range through our faults
+        if (lock_regions_ && mlock2(address, length, MLOCK_ONFAULT) == -1)
+            err(EXIT_FAILURE, "mlock2");
+    }
+
+    void map_pages(long uffd, void *address, void *const *frames,
+                   size_t count, int) override {
+        for (size_t i = 0; i < count; i++) {
+            struct uffdio_move move;
+            move.dst = (unsigned long)address + i * page_size_;
+            move.src = (unsigned long)frames[i];
+            move.len = page_size_;
+            move.mode = UFFDIO_MOVE_MODE_DONTWAKE;
+            move.move = 0;
+            while (ioctl(uffd, UFFDIO_MOVE, &move) == -1) {
+                // EEXIST: mapped already, the frame stays in the pool
+                if (errno == EEXIST) break;
+                if (errno != EAGAIN) err(EXIT_FAILURE, "ioctl-UFFDIO_MOVE");
+                move.move = 0;
+            }
+        }
+    }
+
+    void drop_pages(void *address, size_t length) override {
+        if (!lock_regions_) return UffdCopyBackend::drop_pages(address, length);
+        if (madvise(address, length, MADV_DONTNEED_LOCKED) == -1)
+            err(EXIT_FAILURE, "madvise-MADV_DONTNEED_LOCKED");
+    }
+
+   private:
+    bool lock_regions_;
+};
+
+/**
+ * Anonymous regions are shared mappings of a memfd. The engine writes a
+ * page's content through a second mapping, which puts the page into the
+ * page cache, and UFFDIO_CONTINUE maps that page at the faulting address:
+ * no copy, no PTEditor, and the region can be shared with other processes
+ * through the memfd.
+ */
+class UffdMinorBackend final : public UffdCopyBackend {
+   public:
+    const char *name() const override { return "uffd-minor"; }
+
+    uint64_t uffd_features() const override {
+        return UFFD_FEATURE_MISSING_SHMEM | UFFD_FEATURE_MINOR_SHMEM;
+    }
+
+    bool supports_region(int, bool file_backed) const override {
+        return !file_backed;
+    }
+
+    // first touches are missing faults, a zapped PTE of a page in the page
+    // cache a minor one
+    uint64_t register_mode() const override {
+        return UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_MINOR;
+    }
+
+    bool shmem_backed() const override { return true; }
+
+    void map_pages(long uffd, void *address, void *const *, size_t count,
+                   int) override {
+        struct uffdio_continue cont;
+        cont.range.start = (unsigned long)address;
+        cont.range.len = count * page_size_;
+        cont.mode = UFFDIO_CONTINUE_MODE_DONTWAKE;
+        cont.mapped = 0;
+        while (ioctl(uffd, UFFDIO_CONTINUE, &cont) == -1) {
+            // EEXIST: the page is mapped already, skip it
+            if (errno != EAGAIN && errno != EEXIST)
+                err(EXIT_FAILURE, "ioctl-UFFDIO_CONTINUE");
+            size_t done = cont.mapped > 0 ? cont.mapped : 0;
+            if (errno == EEXIST) done += page_size_;
+            if (done >= cont.range.len) break;
+            cont.range.start += done;
+            cont.range.len -= done;
+            cont.mapped = 0;
+        }
+    }
+
+    // memfd pages are zero already
+    bool map_zero_pages(long, void *, size_t) override { return false; }
+
+    // the pages live on in the memfd, free them there
+    void drop_pages(void *address, size_t length) override {
+        if (madvise(address, length, MADV_REMOVE) == -1)
+            err(EXIT_FAILURE, "madvise-MADV_REMOVE");
+    }
+};
+
+// UFFD_FEATURE_* this kernel has, the API handshake reports them
+static uint64_t kernel_uffd_features() {
+    long uffd = syscall(SYS_userfaultfd, O_CLOEXEC);
+    if (uffd == -1) return 0;
+    struct uffdio_api uffdio_api;
+    uffdio_api.api = UFFD_API;
+    uffdio_api.features = 0;
+    uint64_t features =
+        ioctl(uffd, UFFDIO_API, &uffdio_api) == 0 ? uffdio_api.features : 0;
+    close(uffd);
+    return features;
+}
+
+FaultBackend *create_uffd_copy_backend() {
+    // UFFDIO_COPY_MODE_WP and UFFDIO_WRITEPROTECT on anonymous memory
+    return new UffdCopyBackend(kernel_uffd_features() &
+                               UFFD_FEATURE_PAGEFAULT_FLAG_WP);
+}
+
+FaultBackend *create_uffd_move_backend(bool lock_regions) {
+    if (!(kernel_uffd_features() & UFFD_FEATURE_MOVE)) return nullptr;
+    return new UffdMoveBackend(lock_regions);
+}
+
+FaultBackend *create_uffd_minor_backend() {
+    if (!(kernel_uffd_features() & UFFD_FEATURE_MINOR_SHMEM)) return nullptr;
+    return new UffdMinorBackend();
+}
@@ -0,0 +1,92 @@
+#include "ul_buffer_pool.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <memory>
+
+#include "page_latch.h"
+#include "user_level_mmap.h"
+
+struct ul_pool {
+    char *base;
+    size_t num_pages;
+    std::unique_ptr<PageLatch[]> latches;
+};
+
+static constexpr size_t POOL_PAGE_SIZE = 4096;
+
+struct ul_pool *ul_pool_open(int fd, size_t num_pages, int flags) {
+    if (sysconf(_SC_PAGE_SIZE) != (long)POOL_PAGE_SIZE ||
+        (flags != MAP_SHARED && flags != MAP_PRIVATE)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    if (num_pages == 0) {
+        struct stat st;
+        if (fstat(fd, &st) == -1) return nullptr;
+        num_pages = st.st_size / POOL_PAGE_SIZE;
+        if (num_pages == 0) {
+            errno = EINVAL;
+            return nullptr;
+        }
+    }
+
+    std::unique_ptr<ul_pool> pool(new ul_pool{nullptr, num_pages, nullptr});
+    pool->latches.reset(new PageLatch[num_pages]);
+    void *base = ul_mmap(nullptr, num_pages * POOL_PAGE_SIZE,
+                         PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (base == MAP_FAILED) return nullptr;
+    pool->base = (char *)base;
+    // fails if another thread ul_munmap()ed the range meanwhile
+    if (attach_page_latches(base, pool->latches.get()) == -1) return nullptr;
+    return pool.release();
+}
+
+int ul_pool_close(struct ul_pool *pool) {
+    int ret = ul_munmap(pool->base, pool->num_pages * POOL_PAGE_SIZE);
+    delete pool;
+    return ret;
+}
+
+void *ul_fix(struct ul_pool *pool, uint64_t pid, enum ul_latch mode,
+             uint64_t *version) {
+    if (pid >= pool->num_pages) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    PageLatch &latch = pool->latches[pid];
+    switch (mode) {
+        case UL_LATCH_EXCLUSIVE:
+            latch.lock_exclusive();
+            break;
+        case UL_LATCH_SHARED:
+            latch.lock_shared();
+            break;
+        case UL_LATCH_OPTIMISTIC:
+            *version = latch.read_optimistic();
+            break;
+    }
+    return pool->base + pid * POOL_PAGE_SIZE;
+}
+
+int ul_unfix(struct ul_pool *pool, uint64_t pid, enum ul_latch mode,
+             uint64_t version) {
+    if (pid >= pool->num_pages) {
+        errno = EINVAL;
+        return -1;
+    }
+    PageLatch &latch = pool->latches[pid];
+    switch (mode) {
+        case UL_LATCH_EXCLUSIVE:
+            latch.unlock_exclusive();
+            break;
+        case UL_LATCH_SHARED:
+            latch.unlock_shared();
+            break;
+        case UL_LATCH_OPTIMISTIC:
+            return latch.validate(version) ? 0 : -1;
+    }
+    return 0;
+}
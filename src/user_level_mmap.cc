@@ -2,23 +2,38 @@
 
 #include <err.h>
 #include <fcntl.h>
-#include <jemalloc/jemalloc.h>
 #include <linux/userfaultfd.h>
-#include <poll.h>
-#include <ptedit_header.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <system_error>
 #include <thread>
-#include <unordered_map>
+#include <vector>
 
+#include "fault_backend.h"
+#include "fault_handler_pool.h"
+#include "io_uring_engine.h"
+#include "page_latch.h"
 #include "phy_page_pool.h"
 
 #define COLOR_YELLOW "\x1b[33m"
@@ -27,191 +42,1765 @@
 
 static int PAGE_SIZE;
 
+// uffd messages drained per read() by default
+static constexpr int DEFAULT_FAULT_BATCH = 64;
+// 1GiB of 4KiB frames, if the frames are mapped into regions
+static constexpr size_t DEFAULT_POOL_PAGES = 262144;
+static constexpr size_t POOL_SHARDS = 8;
+// pages mapped per fault at most, the window must stay within one PT page
+static constexpr size_t DEFAULT_FAULT_AROUND_PAGES = 16;
+static constexpr size_t MAX_FAULT_AROUND_PAGES = 512;
+// pages mapped by one leaf page table
+static constexpr size_t PAGES_PER_PT = 512;
+static constexpr unsigned DEFAULT_IO_URING_DEPTH = 256;
+static constexpr size_t DEFAULT_EVICT_BATCH = 64;
+// resident pages per thread when a region is released in parallel
+static constexpr size_t PARALLEL_RELEASE_PAGES = 65536;
+
+// frames[] marker of a page whose content is being read asynchronously
+static void *const FRAME_INFLIGHT = (void *)1;
+// frames[] marker of a page being evicted
+static void *const FRAME_EVICTING = (void *)2;
+// frames[] marker of an anonymous page mapped read-only to zeros, the
+// first write replaces it with a frame
+static void *const FRAME_ZERO = (void *)3;
+
+// kinds of a fault, kept in the low bits of its page address
+static constexpr __u64 FAULT_MINOR = 1;
+static constexpr __u64 FAULT_WRITE = 2;
+static constexpr __u64 FAULT_WP = 4;
+
+/**
+ * Counters of a region, see struct ul_stats; resident pages are counted by
+ * the region itself.
+ */
+struct RegionStats {
+    std::atomic<uint64_t> faults{0};
+    std::atomic<uint64_t> read_faults{0};
+    std::atomic<uint64_t> write_faults{0};
+    std::atomic<uint64_t> bytes_read{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> write_backs{0};
+    std::atomic<uint64_t> fault_latency[UL_LATENCY_BUCKETS] = {};
+
+    // count faults that were served in ns nanoseconds
+    void add_latency(uint64_t ns, uint64_t faults) {
+        int bucket = 63 - __builtin_clzll(ns | 1);
+        bucket = std::min(bucket, UL_LATENCY_BUCKETS - 1);
+        fault_latency[bucket].fetch_add(faults, std::memory_order_relaxed);
+    }
+
+    void add_to(struct ul_stats *stats) const {
+        stats->faults += faults.load(std::memory_order_relaxed);
+        stats->read_faults += read_faults.load(std::memory_order_relaxed);
+        stats->write_faults += write_faults.load(std::memory_order_relaxed);
+        stats->bytes_read += bytes_read.load(std::memory_order_relaxed);
+        stats->evictions += evictions.load(std::memory_order_relaxed);
+        stats->write_backs += write_backs.load(std::memory_order_relaxed);
+        for (int i = 0; i < UL_LATENCY_BUCKETS; i++)
+            stats->fault_latency[i] +=
+                fault_latency[i].load(std::memory_order_relaxed);
+    }
+
+    void add(const RegionStats &other) {
+        struct ul_stats sum;
+        memset(&sum, 0, sizeof(sum));
+        other.add_to(&sum);
+        faults += sum.faults;
+        read_faults += sum.read_faults;
+        write_faults += sum.write_faults;
+        bytes_read += sum.bytes_read;
+        evictions += sum.evictions;
+        write_backs += sum.write_backs;
+        for (int i = 0; i < UL_LATENCY_BUCKETS; i++)
+            fault_latency[i] += sum.fault_latency[i];
+    }
+};
+
+static uint64_t nanos_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+static bool is_frame(void *frame) {
+    return frame != nullptr && frame != FRAME_INFLIGHT &&
+           frame != FRAME_EVICTING;
+}
+
+// a page taken out of the frame table by pin_page(), and its frame
+struct PinnedPage {
+    size_t idx;
+    void *frame;
+};
+
 // page fault handler arguments
 struct PFhandle_args {
-    PFhandle_args(long uffd_, int fd_, off_t offset_, void *base_addr_)
-        : uffd(uffd_), fd(fd_), offset(offset_), base_addr(base_addr_) {}
+    PFhandle_args(long uffd_, int fd_, off_t offset_, void *base_addr_,
+                  size_t length_)
+        : uffd(uffd_),
+          fd(fd_),
+          offset(offset_),
+          base_addr(base_addr_),
+          length(length_),
+          num_pages(length_ / PAGE_SIZE),
+          frames(new std::atomic<void *>[length_ / PAGE_SIZE]()),
+          first_block((size_t)base_addr_ / PAGE_SIZE / PAGES_PER_PT),
+          num_blocks(((size_t)base_addr_ + length_ - 1) / PAGE_SIZE /
+                         PAGES_PER_PT -
+                     first_block + 1),
+          block_resident(new std::atomic<uint16_t>[num_blocks]()) {}
+
+    long uffd = 0;  // need to get events from uffd
+    int fd = -1;    // for file backed up mmap
+    bool direct_io = false;  // fd is opened with O_DIRECT
+    // buffered fd for writes of the EOF page, direct I/O needs whole blocks
+    int tail_fd = -1;
+    bool shared = false;  // MAP_SHARED, written pages go back to the file
+    // protection the backend installs pages with, see ul_mprotect()
+    std::atomic<int> prot{PROT_READ | PROT_WRITE};
+    FaultBackend *backend = nullptr;
+    // shmem_backed() backends: the memfd behind the region, and our own
+    // mapping of it through which the pages are filled
+    int memfd = -1;
+    char *alias = nullptr;
+    off_t offset = 0;
+    void *base_addr = NULL;  // mmap base address
+    size_t length = 0;
+    size_t num_pages = 0;
+
+    // page_pool frame backing each page of the region, nullptr if not mapped;
+    // with a backend that copies the frames, the page's own address
+    std::unique_ptr<std::atomic<void *>[]> frames;
+    // resident pages per PT page the region spans, scans skip empty ones
+    size_t first_block;
+    size_t num_blocks;
+    std::unique_ptr<std::atomic<uint16_t>[]> block_resident;
+
+    size_t block_index(size_t idx) const {
+        return ((size_t)base_addr / PAGE_SIZE + idx) / PAGES_PER_PT -
+               first_block;
+    }
+    std::atomic<uint16_t> &block_of(size_t idx) {
+        return block_resident[block_index(idx)];
+    }
+
+    // MAP_HUGETLB: huge_pool frame mapped by the PMD of each block, nullptr
+    // if the block is not mapped huge, and the PMD it replaced
+    std::unique_ptr<std::atomic<void *>[]> huge_frames;
+    std::unique_ptr<size_t[]> huge_old_pmd;
+
+    bool huge_block(size_t block) const {
+        return huge_frames &&
+               huge_frames[block].load(std::memory_order_acquire) != nullptr;
+    }
+
+    // ul_config.wp_dirty_tracking: a bit per 4KiB page written since it was
+    // last written back, nullptr if the region is not tracked. A page is
+    // only writable while its bit is set.
+    std::unique_ptr<std::atomic<uint64_t>[]> dirty;
+
+    void set_dirty(size_t idx) {
+        dirty[idx / 64].fetch_or(1ull << (idx % 64));
+    }
+    bool is_dirty(size_t idx) const {
+        return dirty[idx / 64].load() & (1ull << (idx % 64));
+    }
+    bool take_dirty(size_t idx) {
+        return dirty[idx / 64].fetch_and(~(1ull << (idx % 64))) &
+               (1ull << (idx % 64));
+    }
+
+    uint64_t pool_handle = 0;  // registration in handler_pool
+    // set under evict_mu once ul_munmap() starts releasing the frames
+    bool releasing = false;
+    // calls working on pinned pages of the region outside evict_mu, taken
+    // under evict_mu unless releasing; ul_munmap() waits for them
+    std::atomic<int> writers{0};
+    // ul_pool regions: latch of each page, eviction skips latched pages;
+    // set under evict_mu
+    PageLatch *latches = nullptr;
+
+    // MADV_NORMAL, MADV_SEQUENTIAL or MADV_RANDOM, see fault_around_window()
+    std::atomic<int> advice{MADV_NORMAL};
+    // current fault-around window in pages, see fault_around_window()
+    std::atomic<size_t> fault_around{1};
+    // page index right behind the last window, a fault here is sequential
+    std::atomic<size_t> next_seq_idx{0};
+
+    // file reads submitted to an io_uring and not completed yet
+    std::atomic<int> inflight_reads{0};
+    // MADV_WILLNEED ranges queued or being claimed, and whether they must
+    // stop because the region goes away
+    std::atomic<int> prefetches{0};
+    std::atomic<bool> unmapping{false};
+
+    // sqpoll mode: the uffd is read through io_rings[ring] instead of epoll
+    int ring = -1;
+    std::vector<struct uffd_msg> ring_msgs;
+    std::atomic<bool> ring_closing{false};
+    std::atomic<bool> ring_read_done{false};
+
+    RegionStats stats;
+    std::atomic<size_t> resident_pages{0};
+};
+
+/**
+ * A file read of a fault-around run in flight on an io_uring. Its address is
+ * the request's user_data.
+ */
+struct PageRange {
+    size_t first_idx;
+    size_t count;
+};
+
+struct PendingRead {
+    PFhandle_args *pfh_args;
+    size_t first_idx;
+    size_t count;
+    // when the fault was read, for its latency
+    std::chrono::steady_clock::time_point start;
+    // a MADV_WILLNEED read, no fault's latency to record
+    bool prefetch;
+    std::vector<void *> frames;
+    std::vector<struct iovec> iov;
+};
+
+std::mutex mmap_regions_mu;
+// ordered by address, to find the region containing an address
+std::map<void *, std::shared_ptr<PFhandle_args>> mmap_regions;
+// counters of the regions unmapped so far, under mmap_regions_mu
+static RegionStats unmapped_stats;
+
+static ul_config engine_config;
+static std::once_flag engine_init_flag;
+static FaultHandlerPool *handler_pool = nullptr;
+// physical frames of all regions, bounds their resident memory
+static MemoryPool *page_pool = nullptr;
+// 2MiB frames of MAP_HUGETLB regions, nullptr if not configured
+static MemoryPool *huge_pool = nullptr;
+static size_t HUGE_PAGE_SIZE;
+// one ring per handler_pool worker, empty unless ul_config.use_io_uring
+static std::vector<IoUring *> io_rings;
+// nullptr if PTEditor is not available
+static FaultBackend *ptedit_backend = nullptr;
+static FaultBackend *uffd_copy_backend = nullptr;
+// nullptr if the kernel has no UFFDIO_MOVE
+static FaultBackend *uffd_move_backend = nullptr;
+// nullptr if the kernel has no minor faults on shmem
+static FaultBackend *uffd_minor_backend = nullptr;
+static FaultBackend *default_backend = nullptr;
+static std::atomic<size_t> next_ring{0};
+
+// file-backed regions, the CLOCK hand of evict_pages() sweeps over them
+static std::mutex evict_mu;
+static std::vector<PFhandle_args *> evict_regions;
+static size_t clock_region = 0;
+static size_t clock_page = 0;
+
+static void reap_io_ring(size_t worker);
+
+/**
+ * Thrown by engine_init() with the errno of its failure. std::call_once()
+ * then leaves engine_init_flag unset, a later call tries again.
+ */
+struct EngineInitError {
+    int error;
+};
+
+// undo the backend probing of a failed engine_init()
+static void destroy_backends() {
+    for (FaultBackend **backend : {&ptedit_backend, &uffd_copy_backend,
+                                   &uffd_move_backend, &uffd_minor_backend}) {
+        delete *backend;
+        *backend = nullptr;
+    }
+    default_backend = nullptr;
+}
+
+static void engine_init() {
+    PAGE_SIZE = sysconf(_SC_PAGE_SIZE);
+
+    if (engine_config.fault_batch <= 0) {
+        engine_config.fault_batch = DEFAULT_FAULT_BATCH;
+    }
+
+    size_t fault_around = engine_config.fault_around_pages;
+    if (fault_around == 0) fault_around = DEFAULT_FAULT_AROUND_PAGES;
+    // round down to a power of two
+    while (fault_around & (fault_around - 1)) fault_around &= fault_around - 1;
+    engine_config.fault_around_pages =
+        std::min(fault_around, MAX_FAULT_AROUND_PAGES);
+
+    if (engine_config.evict_batch == 0) {
+        engine_config.evict_batch = DEFAULT_EVICT_BATCH;
+    }
+    if (engine_config.io_uring_depth == 0) {
+        engine_config.io_uring_depth = DEFAULT_IO_URING_DEPTH;
+    }
+
+    size_t num_handlers = engine_config.handler_threads;
+    if (num_handlers == 0) {
+        num_handlers = std::min(std::thread::hardware_concurrency(), 8u);
+    }
+    if (engine_config.handlers_per_region <= 0 ||
+        (size_t)engine_config.handlers_per_region > num_handlers) {
+        engine_config.handlers_per_region = num_handlers;
+    }
+
+    uffd_copy_backend = create_uffd_copy_backend();
+    uffd_minor_backend = create_uffd_minor_backend();
+    if (engine_config.backend == UL_BACKEND_DEFAULT ||
+        engine_config.backend == UL_BACKEND_PTEDIT) {
+        /*init PTEditor*/
+        ptedit_backend =
+            create_ptedit_backend(engine_config.eager_page_tables != 0);
+        if (ptedit_backend == nullptr) {
+            if (engine_config.backend == UL_BACKEND_PTEDIT) {
+                fprintf(stderr,
+                        "Error: Could not initalize PTEditor, did you load "
+                        "the kernel module?\n");
+                destroy_backends();
+                throw EngineInitError{ENODEV};
+            }
+            fprintf(stderr,
+                    "Warning: PTEditor not available, resolving faults with "
+                    "UFFDIO_COPY\n");
+        }
+    }
+    // only PTEditor maps pool frames into regions, behind the kernel's back
+    bool lock_pool = ptedit_backend != nullptr;
+    uffd_move_backend = create_uffd_move_backend(lock_pool);
+    if (engine_config.backend == UL_BACKEND_UFFD_MOVE &&
+        uffd_move_backend == nullptr) {
+        destroy_backends();
+        throw EngineInitError{ENODEV};
+    }
+    if (engine_config.backend == UL_BACKEND_UFFD_MINOR &&
+        uffd_minor_backend == nullptr) {
+        destroy_backends();
+        throw EngineInitError{ENODEV};
+    }
+    if (engine_config.backend == UL_BACKEND_UFFD_MOVE) {
+        default_backend = uffd_move_backend;
+    } else if (engine_config.backend == UL_BACKEND_UFFD_MINOR) {
+        default_backend = uffd_minor_backend;
+    } else {
+        default_backend = ptedit_backend ? ptedit_backend : uffd_copy_backend;
+    }
+
+    size_t pool_pages = engine_config.pool_pages;
+    if (pool_pages == 0 && lock_pool) {
+        pool_pages = DEFAULT_POOL_PAGES;
+    } else if (pool_pages == 0) {
+        // the copying backends hand a frame back right after mapping it:
+        // enough for a fault-around window per handler and per read in
+        // flight on its io_uring, and one for MADV_WILLNEED
+        size_t reads =
+            engine_config.use_io_uring ? engine_config.io_uring_depth : 0;
+        pool_pages = (num_handlers * (1 + reads) + 1) *
+                     engine_config.fault_around_pages;
+    }
+    pool_pages = std::max(pool_pages, POOL_SHARDS);
+
+    // never destroyed: regions may stay mapped until process exit
+    try {
+        page_pool = new MemoryPool(POOL_SHARDS, pool_pages / POOL_SHARDS,
+                                   PAGE_SIZE, false, lock_pool);
+    } catch (const std::system_error &e) {
+        fprintf(stderr,
+                "Error: can't lock the page pool (%s), raise RLIMIT_MEMLOCK "
+                "or lower ul_config.pool_pages\n",
+                strerror(e.code().value()));
+        destroy_backends();
+        throw EngineInitError{e.code().value()};
+    } catch (const std::bad_alloc &) {
+        destroy_backends();
+        throw EngineInitError{ENOMEM};
+    }
+    if (ptedit_backend)
+        ptedit_backend->register_frames(page_pool->arena(),
+                                        page_pool->arena_size());
+
+    size_t prezero_pages = engine_config.prezero_pages;
+    if (prezero_pages == 0) prezero_pages = pool_pages / 16;
+    page_pool->start_zeroing(prezero_pages);
+    handler_pool = new FaultHandlerPool(num_handlers);
+
+    HUGE_PAGE_SIZE = PAGES_PER_PT * PAGE_SIZE;
+    if (engine_config.huge_pool_pages > 0) {
+        try {
+            // huge pages are never swapped out, no need to lock them
+            huge_pool = new MemoryPool(1, engine_config.huge_pool_pages,
+                                       HUGE_PAGE_SIZE, true, false);
+        } catch (const std::bad_alloc &) {
+            fprintf(stderr,
+                    "Warning: can't reserve %zu huge pages (vm.nr_hugepages?), "
+                    "MAP_HUGETLB regions use 4KiB pages\n",
+                    engine_config.huge_pool_pages);
+        }
+    }
+
+    if (engine_config.use_io_uring) {
+        for (size_t i = 0; i < num_handlers; i++) {
+            auto ring = new IoUring(engine_config.io_uring_depth,
+                                    engine_config.io_uring_sqpoll);
+            if (!ring->ok()) {
+                delete ring;
+                break;
+            }
+            io_rings.push_back(ring);
+        }
+        if (io_rings.size() != num_handlers) {
+            fprintf(stderr,
+                    "Warning: io_uring unavailable, file-backed faults fall "
+                    "back to synchronous reads\n");
+            for (auto ring : io_rings) delete ring;
+            io_rings.clear();
+        }
+        for (size_t i = 0; i < io_rings.size(); i++) {
+            handler_pool->add(io_rings[i]->event_fd(), reap_io_ring, i);
+        }
+    }
+}
+
+/**
+ * Initialize the engine with engine_config unless done already. Returns
+ * false with errno set if that fails.
+ */
+static bool ensure_engine() {
+    try {
+        std::call_once(engine_init_flag, engine_init);
+    } catch (const EngineInitError &e) {
+        errno = e.error;
+        return false;
+    }
+    return true;
+}
+
+int ul_init(const struct ul_config *config) {
+    bool initialized_now = false;
+    try {
+        std::call_once(engine_init_flag, [&] {
+            engine_config = config != nullptr ? *config : ul_config();
+            engine_init();
+            initialized_now = true;
+        });
+    } catch (const EngineInitError &e) {
+        // ul_mmap() would try again with these settings otherwise
+        engine_config = ul_config();
+        errno = e.error;
+        return -1;
+    }
+    if (!initialized_now) {
+        errno = EBUSY;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Call fn(idx, frame) for every resident 4KiB page in [first_idx, last_idx)
+ * of the region. PT pages without resident pages are skipped as a whole, so
+ * the cost follows the number of resident pages rather than the length.
+ * Blocks mapped by a huge PMD are skipped, see for_each_huge_block().
+ */
+template <typename Fn>
+static void for_each_resident(PFhandle_args *pfh_args, size_t first_idx,
+                              size_t last_idx, Fn &&fn) {
+    size_t base_pfn = (size_t)pfh_args->base_addr / PAGE_SIZE;
+    for (size_t idx = first_idx; idx < last_idx;) {
+        size_t block_end = std::min(
+            ((base_pfn + idx) / PAGES_PER_PT + 1) * PAGES_PER_PT - base_pfn,
+            last_idx);
+        if (pfh_args->block_of(idx).load(std::memory_order_relaxed) == 0 ||
+            pfh_args->huge_block(pfh_args->block_index(idx))) {
+            idx = block_end;
+            continue;
+        }
+        for (; idx < block_end; idx++) {
+            void *frame = pfh_args->frames[idx].load(std::memory_order_acquire);
+            if (is_frame(frame)) fn(idx, frame);
+        }
+    }
+}
+
+/**
+ * Call fn(first_idx, frame) for every block mapped by a huge PMD that
+ * overlaps [first_idx, last_idx), first_idx is the block's first page.
+ */
+template <typename Fn>
+static void for_each_huge_block(PFhandle_args *pfh_args, size_t first_idx,
+                                size_t last_idx, Fn &&fn) {
+    if (!pfh_args->huge_frames || first_idx >= last_idx) return;
+    size_t base_pfn = (size_t)pfh_args->base_addr / PAGE_SIZE;
+    for (size_t block = pfh_args->block_index(first_idx);
+         block <= pfh_args->block_index(last_idx - 1); block++) {
+        void *frame = pfh_args->huge_frames[block].load(std::memory_order_acquire);
+        if (frame == nullptr) continue;
+        fn((pfh_args->first_block + block) * PAGES_PER_PT - base_pfn, frame);
+    }
+}
+
+/**
+ * Write region pages [first_idx, first_idx + count) back to the file, the
+ * part beyond EOF is dropped like the kernel does for shared mappings.
+ * Returns 0, or -1 with errno set (e.g. EIO, ENOSPC) if the file did not
+ * take all of them.
+ */
+static int write_back(PFhandle_args *pfh_args, size_t first_idx,
+                      size_t count, void *const *frames) {
+    struct stat st;
+    if (fstat(pfh_args->fd, &st) == -1) return -1;
+    off_t start = pfh_args->offset + first_idx * PAGE_SIZE;
+    if (start >= st.st_size) return 0;
+    count = std::min(count, (size_t)(st.st_size - start + PAGE_SIZE - 1) /
+                                PAGE_SIZE);
+    off_t end = start + count * PAGE_SIZE;
+    size_t tail = end > st.st_size ? end - st.st_size : 0;
+    size_t whole = tail == 0 ? count : count - 1;
+
+    struct iovec iov[MAX_FAULT_AROUND_PAGES];
+    for (size_t done = 0; done < whole;) {
+        size_t n = std::min(whole - done, MAX_FAULT_AROUND_PAGES);
+        for (size_t i = 0; i < n; i++) {
+            iov[i].iov_base = frames[done + i];
+            iov[i].iov_len = PAGE_SIZE;
+        }
+        ssize_t written =
+            pwritev(pfh_args->fd, iov, n, start + done * PAGE_SIZE);
+        if (written == -1) return -1;
+        // a regular file takes part of a write only when it is out of space;
+        // the pages written in full count, the rest is tried again
+        if ((size_t)written < PAGE_SIZE) {
+            errno = ENOSPC;
+            return -1;
+        }
+        done += written / PAGE_SIZE;
+    }
+    if (whole < count) {
+        ssize_t written = pwrite(pfh_args->tail_fd, frames[whole],
+                                 PAGE_SIZE - tail, start + whole * PAGE_SIZE);
+        if (written == -1) return -1;
+        if ((size_t)written != PAGE_SIZE - tail) {
+            errno = ENOSPC;
+            return -1;
+        }
+    }
+    pfh_args->stats.write_backs += count;
+    return 0;
+}
+
+/**
+ * Write the region pages listed in ascending order back to the file, one
+ * write per run of adjacent pages. A run that fails does not stop the
+ * others: its pages are added to failed if given, and -1 is returned with
+ * the errno of the first failure.
+ */
+static int write_back_pages(PFhandle_args *pfh_args,
+                            const std::vector<PinnedPage> &pages,
+                            std::vector<PinnedPage> *failed = nullptr) {
+    int error = 0;
+    std::vector<void *> frames;
+    for (size_t i = 0; i < pages.size();) {
+        size_t j = i;
+        frames.clear();
+        while (j < pages.size() && pages[j].idx == pages[i].idx + (j - i)) {
+            frames.push_back(pages[j].frame);
+            j++;
+        }
+        if (write_back(pfh_args, pages[i].idx, j - i, frames.data()) == -1) {
+            if (error == 0) error = errno;
+            if (failed != nullptr)
+                failed->insert(failed->end(), pages.begin() + i,
+                               pages.begin() + j);
+        }
+        i = j;
+    }
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Pin the resident page idx whose frame is frame: its frame table entry
+ * becomes FRAME_EVICTING, so that eviction, MADV_DONTNEED and ul_msync()
+ * leave it alone and its faults wait, until unpin_page() or until it is
+ * released. The page stays mapped. Returns false if the entry changed.
+ */
+static bool pin_page(PFhandle_args *pfh_args, size_t idx, void *frame) {
+    return pfh_args->frames[idx].compare_exchange_strong(
+        frame, FRAME_EVICTING, std::memory_order_acq_rel);
+}
+
+static void unpin_page(PFhandle_args *pfh_args, size_t idx, void *frame) {
+    pfh_args->frames[idx].store(frame, std::memory_order_release);
+}
+
+/**
+ * Append the resident pages of [first_idx, last_idx) of a dirty-tracked
+ * region whose dirty bit is set to pages, in ascending order, without
+ * taking the bits. Clean stretches cost a load per 64 pages.
+ */
+static void find_dirty_range(PFhandle_args *pfh_args, size_t first_idx,
+                             size_t last_idx,
+                             std::vector<PinnedPage> *pages) {
+    for (size_t word = first_idx / 64; word * 64 < last_idx; word++) {
+        uint64_t mask = ~0ull;
+        if (word == first_idx / 64) mask &= ~0ull << (first_idx % 64);
+        if ((word + 1) * 64 > last_idx)
+            mask &= ~0ull >> ((word + 1) * 64 - last_idx);
+        uint64_t bits =
+            pfh_args->dirty[word].load(std::memory_order_relaxed) & mask;
+        for (; bits != 0; bits &= bits - 1) {
+            size_t idx = word * 64 + __builtin_ctzll(bits);
+            void *frame = pfh_args->frames[idx].load(std::memory_order_acquire);
+            // marked by a write fault that raced with the page's eviction
+            if (is_frame(frame)) pages->push_back({idx, frame});
+        }
+    }
+}
+
+struct Victim {
+    PFhandle_args *pfh_args;
+    size_t idx;
+    void *frame;
+    bool dirty;
+    PageLatch *latch;  // held until the frame is gone, or nullptr
+};
+
+/**
+ * Reclaim up to target frames from file-backed regions, returns how many
+ * went back to page_pool.
+ *
+ * A CLOCK hand sweeps the pages of all file-backed regions whose backend maps
+ * the frames themselves: a page whose accessed bit is set gets its bit
+ * cleared and a second chance, otherwise it is a victim. The victims' PTEs
+ * are cleared first and their TLB entries invalidated afterwards in one go;
+ * only then is their content final, so dirty pages of shared regions are
+ * written back after the flush. Dirty pages of private regions have nowhere
+ * to go and stay.
+ *
+ * A fault on a victim meanwhile sees FRAME_EVICTING in the frame table and
+ * waits in handle_missing_page() until the frame is gone. Pages of a ul_pool
+ * are only victims if their latch is free, it is held until they are gone.
+ *
+ * A failed write-back is fatal: eviction runs for a fault that has nobody to
+ * report it to, and the victims' frames are about to be reused.
+ */
+static size_t evict_pages(size_t target) {
+    std::lock_guard<std::mutex> guard(evict_mu);
+    // another thread evicted while we waited
+    if (page_pool->free_pages() > 0) return 0;
+
+    size_t total = 0;
+    for (auto region : evict_regions) total += region->num_pages;
+
+    std::vector<Victim> victims;
+    // two rounds: the first may only clear accessed bits
+    for (size_t scanned = 0; scanned < 2 * total && victims.size() < target;
+         scanned++) {
+        if (clock_region >= evict_regions.size()) clock_region = 0;
+        PFhandle_args *pfh_args = evict_regions[clock_region];
+        if (clock_page >= pfh_args->num_pages) {
+            clock_region++;
+            clock_page = 0;
+            continue;
+        }
+        size_t idx = clock_page++;
+
+        void *frame = pfh_args->frames[idx].load(std::memory_order_acquire);
+        // huge frames stay until the region is unmapped
+        if (!is_frame(frame) || pfh_args->huge_block(pfh_args->block_index(idx)))
+            continue;
+
+        void *address = (char *)pfh_args->base_addr + idx * PAGE_SIZE;
+        FaultBackend *backend = pfh_args->backend;
+        unsigned flags = backend->page_flags(address);
+        if (flags & FaultBackend::PAGE_ACCESSED) {
+            backend->clear_accessed(address);
+            continue;
+        }
+        if ((flags & FaultBackend::PAGE_DIRTY) && !pfh_args->shared) continue;
+
+        PageLatch *latch =
+            pfh_args->latches ? &pfh_args->latches[idx] : nullptr;
+        if (latch && !latch->try_lock_exclusive()) continue;
+        if (!pfh_args->frames[idx].compare_exchange_strong(frame,
+                                                           FRAME_EVICTING)) {
+            if (latch) latch->unlock_unchanged();
+            continue;
+        }
+        int old_flags = backend->unmap_page(address, !pfh_args->shared);
+        if (old_flags == -1) {
+            // written since the check
+            pfh_args->frames[idx].store(frame, std::memory_order_release);
+            if (latch) latch->unlock_unchanged();
+            continue;
+        }
+        // a tracked page is marked before its first write lands
+        bool marked = pfh_args->dirty && pfh_args->take_dirty(idx);
+        bool dirty = (old_flags & FaultBackend::PAGE_DIRTY) ||
+                     (marked && pfh_args->shared);
+        victims.push_back({pfh_args, idx, frame, dirty, latch});
+    }
+
+    // evict_regions only holds regions of the PTEditor backend
+    if (!victims.empty()) {
+        std::vector<void *> addresses;
+        for (auto &victim : victims) {
+            addresses.push_back((char *)victim.pfh_args->base_addr +
+                                victim.idx * PAGE_SIZE);
+        }
+        victims[0].pfh_args->backend->flush_tlb(addresses.data(),
+                                                addresses.size());
+    }
+
+    for (size_t i = 0; i < victims.size();) {
+        Victim &victim = victims[i];
+        if (!victim.dirty) {
+            i++;
+            continue;
+        }
+        // consecutive dirty pages of a region are written together
+        void *frames[MAX_FAULT_AROUND_PAGES];
+        size_t j = i;
+        for (; j < victims.size() && j - i < MAX_FAULT_AROUND_PAGES; j++) {
+            if (!victims[j].dirty || victims[j].pfh_args != victim.pfh_args ||
+                victims[j].idx != victim.idx + (j - i))
+                break;
+            frames[j - i] = victims[j].frame;
+        }
+        if (write_back(victim.pfh_args, victim.idx, j - i, frames) == -1)
+            err(EXIT_FAILURE, "write back of evicted pages");
+        i = j;
+    }
+
+    for (auto &victim : victims) {
+        victim.pfh_args->frames[victim.idx].store(nullptr,
+                                                  std::memory_order_release);
+        victim.pfh_args->block_of(victim.idx)--;
+        victim.pfh_args->resident_pages--;
+        victim.pfh_args->stats.evictions++;
+        page_pool->deallocate(victim.frame);
+        if (victim.latch) victim.latch->unlock_unchanged();
+    }
+    return victims.size();
+}
+
+/**
+ * Take a frame for a page about to be populated, nullptr if the pool is
+ * exhausted. Only the page that actually faulted insists on getting one,
+ * it evicts other pages when necessary. zeroed frames come from the
+ * background-zeroed list when possible.
+ */
+static void *take_frame(bool required, bool zeroed = false) {
+    auto allocate = [zeroed] {
+        return zeroed ? page_pool->allocate_zeroed() : page_pool->allocate();
+    };
+    void *frame = allocate();
+    while (frame == nullptr && required) {
+        if (evict_pages(engine_config.evict_batch) == 0 &&
+            page_pool->free_pages() == 0) {
+            errx(EXIT_FAILURE,
+                 "page pool exhausted (%zu pages) and nothing to evict, raise "
+                 "ul_config.pool_pages",
+                 page_pool->capacity());
+        }
+        frame = allocate();
+    }
+    return frame;
+}
+
+// the frame to fill page idx in: the page itself, through the memfd alias,
+// for shmem-backed regions, otherwise a page_pool frame, zeroed already for
+// anonymous regions
+static void *page_frame(PFhandle_args *pfh_args, size_t idx, bool required) {
+    if (pfh_args->alias) return pfh_args->alias + idx * PAGE_SIZE;
+    return take_frame(required, pfh_args->fd == -1);
+}
+
+/**
+ * Fill frames[0..count) with the content of region pages
+ * [first_idx, first_idx + count): one preadv() for file-backed regions,
+ * zeros for anonymous ones (page_frame() hands those out zeroed). The part
+ * of a page beyond EOF reads as zero; with O_DIRECT the read of the EOF page
+ * comes back short just the same.
+ * Returns the number of pages that hold data, the rest are all zeros.
+ */
+static size_t fill_frames(PFhandle_args *pfh_args, size_t first_idx,
+                          size_t count, void **frames) {
+    if (pfh_args->fd == -1) {
+        // a memfd page only exists once written, keep its content though:
+        // another process may have just written it
+        for (size_t i = 0; pfh_args->alias && i < count; i++)
+            __atomic_fetch_or((char *)frames[i], 0, __ATOMIC_RELAXED);
+        return count;
+    }
+
+    struct iovec iov[MAX_FAULT_AROUND_PAGES];
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = frames[i];
+        iov[i].iov_len = PAGE_SIZE;
+    }
+    ssize_t bytes_read = preadv(pfh_args->fd, iov, count,
+                                pfh_args->offset + first_idx * PAGE_SIZE);
+    if (bytes_read < 0) err(EXIT_FAILURE, "preadv");
+    pfh_args->stats.bytes_read += bytes_read;
+    for (size_t i = bytes_read / PAGE_SIZE; i < count; i++) {
+        size_t valid = i == (size_t)bytes_read / PAGE_SIZE
+                           ? bytes_read % PAGE_SIZE
+                           : 0;
+        memset((char *)frames[i] + valid, 0, PAGE_SIZE - valid);
+    }
+    return (bytes_read + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+/**
+ * Pick the fault-around window of a fault on page_idx.
+ *
+ * The window is a naturally aligned block of the region's current
+ * fault_around size, so it never crosses a PT page. The size adapts to the
+ * access pattern: a fault right behind the previous window doubles it (up to
+ * ul_config.fault_around_pages), any other fault halves it, so random access
+ * quickly drops back to mapping single pages. ul_madvise() fixes the size
+ * to the maximum (MADV_SEQUENTIAL) or to one page (MADV_RANDOM).
+ */
+static void fault_around_window(PFhandle_args *pfh_args, size_t page_idx,
+                                size_t *first, size_t *last) {
+    // a heuristic: racing handlers may lose each other's updates
+    size_t max_window = engine_config.fault_around_pages;
+    size_t window = pfh_args->fault_around.load(std::memory_order_relaxed);
+    int advice = pfh_args->advice.load(std::memory_order_relaxed);
+    if (advice == MADV_SEQUENTIAL) {
+        window = max_window;
+    } else if (advice == MADV_RANDOM) {
+        window = 1;
+    } else if (page_idx ==
+               pfh_args->next_seq_idx.load(std::memory_order_relaxed)) {
+        window = std::min(window * 2, max_window);
+    } else {
+        window = std::max(window / 2, (size_t)1);
+    }
+    pfh_args->fault_around.store(window, std::memory_order_relaxed);
+
+    size_t base_pfn = (size_t)pfh_args->base_addr / PAGE_SIZE;
+    size_t start = (base_pfn + page_idx) & ~(window - 1);
+    *first = start < base_pfn ? 0 : start - base_pfn;
+    *last = std::min(start + window - base_pfn, pfh_args->num_pages);
+    pfh_args->next_seq_idx.store(*last, std::memory_order_relaxed);
+}
+
+/**
+ * Give the resident pages of region pages [first_idx, last_idx) protection
+ * prot, with one TLB flush. Pages of zeros and clean pages of dirty-tracked
+ * regions stay read-only, their first write must still fault.
+ */
+static void protect_range(PFhandle_args *pfh_args, size_t first_idx,
+                          size_t last_idx, int prot) {
+    std::vector<void *> addresses, readonly;
+    for_each_resident(pfh_args, first_idx, last_idx, [&](size_t idx,
+                                                          void *frame) {
+        void *address = (char *)pfh_args->base_addr + idx * PAGE_SIZE;
+        bool writable = frame != FRAME_ZERO &&
+                        (!pfh_args->dirty || pfh_args->is_dirty(idx));
+        (writable ? addresses : readonly).push_back(address);
+    });
+    FaultBackend *backend = pfh_args->backend;
+    backend->protect_pages(addresses.data(), addresses.size(), prot);
+    backend->protect_pages(readonly.data(), readonly.size(),
+                           prot & ~PROT_WRITE);
+    addresses.insert(addresses.end(), readonly.begin(), readonly.end());
+    backend->flush_tlb(addresses.data(), addresses.size());
+}
+
+/**
+ * Pages [first_idx, first_idx + count) were just mapped with protection prot
+ * and made resident. A ul_mprotect() meanwhile either finds them, or changed
+ * the protection after we read it: then fix them up here, until the
+ * protection they have is the current one.
+ */
+static void recheck_protection(PFhandle_args *pfh_args, int prot,
+                               size_t first_idx, size_t count) {
+    if (!pfh_args->backend->maps_frames()) return;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (int now; (now = pfh_args->prot.load(std::memory_order_seq_cst)) !=
+                  prot;
+         prot = now) {
+        protect_range(pfh_args, first_idx, first_idx + count, now);
+    }
+}
+
+/**
+ * The protection map_pages() installs pages of a region with protection prot:
+ * without PROT_WRITE in dirty-tracked regions, so that the first write
+ * faults. Backends that leave the protection to the kernel's VMA are only
+ * told whether to write-protect.
+ */
+static int map_prot(PFhandle_args *pfh_args, int prot) {
+    if (pfh_args->dirty) return prot & ~PROT_WRITE;
+    return pfh_args->backend->maps_frames() ? prot : prot | PROT_WRITE;
+}
+
+/**
+ * Map the freshly filled frames of region pages [first_idx, first_idx + count)
+ * through the region's backend. Pages from nr_data on are all zeros, the
+ * backend may map them without a frame.
+ */
+static void map_frames(PFhandle_args *pfh_args, size_t first_idx, size_t count,
+                       void *const *frames, size_t nr_data) {
+    FaultBackend *backend = pfh_args->backend;
+    char *address = (char *)pfh_args->base_addr + first_idx * PAGE_SIZE;
+    int prot = pfh_args->prot.load(std::memory_order_seq_cst);
+    size_t nr_mapped = count;
+    // the kernel's zero page would take writes untracked
+    if (nr_data < count && !pfh_args->dirty &&
+        backend->map_zero_pages(pfh_args->uffd, address + nr_data * PAGE_SIZE,
+                                count - nr_data))
+        nr_mapped = nr_data;
+    backend->map_pages(pfh_args->uffd, address, frames, nr_mapped,
+                       map_prot(pfh_args, prot));
+
+    for (size_t i = 0; i < count; i++) {
+        void *frame = frames[i];
+        if (!backend->maps_frames()) {
+            // the kernel has its own copy, or the frame is the page cache's
+            if (!pfh_args->alias) page_pool->deallocate(frame);
+            frame = address + i * PAGE_SIZE;
+        }
+        pfh_args->frames[first_idx + i].store(frame, std::memory_order_release);
+        pfh_args->block_of(first_idx + i)++;
+    }
+    pfh_args->resident_pages += count;
+    recheck_protection(pfh_args, prot, first_idx, count);
+}
+
+static void wake_range(PFhandle_args *pfh_args, __u64 start, __u64 len) {
+    struct uffdio_range uffdio_range;
+    uffdio_range.start = start;
+    uffdio_range.len = len;
+    if (ioctl(pfh_args->uffd, UFFDIO_WAKE, &uffdio_range) == -1)
+        err(EXIT_FAILURE, "ioctl-UFFDIO_WAKE");
+}
+
+/**
+ * Claim the missing page idx for the calling handler: its frame goes from
+ * nullptr to FRAME_INFLIGHT. The frame table is the in-flight table of the
+ * region, only the claiming handler reads and maps the page, and it wakes
+ * the waiters of all pages it claimed once they are mapped.
+ */
+static bool claim_page(PFhandle_args *pfh_args, size_t idx) {
+    void *expected = nullptr;
+    return pfh_args->frames[idx].compare_exchange_strong(
+        expected, FRAME_INFLIGHT, std::memory_order_acq_rel);
+}
+
+/**
+ * Give up claimed pages [first_idx, first_idx + count). Another handler may
+ * have seen them in flight and left their waiters to us, so wake them: they
+ * fault again.
+ */
+static void unclaim_pages(PFhandle_args *pfh_args, size_t first_idx,
+                          size_t count) {
+    if (count == 0) return;
+    for (size_t i = first_idx; i < first_idx + count; i++) {
+        pfh_args->frames[i].store(nullptr, std::memory_order_release);
+    }
+    wake_range(pfh_args, (__u64)pfh_args->base_addr + first_idx * PAGE_SIZE,
+               count * PAGE_SIZE);
+}
+
+/**
+ * Queue the file read of a claimed fault-around run on the worker's io_uring,
+ * or of a MADV_WILLNEED run with prefetch. Returns false if the ring is full,
+ * the caller then reads synchronously.
+ */
+static bool submit_read(PFhandle_args *pfh_args, size_t worker,
+                        size_t first_idx, size_t count, void *const *frames,
+                        std::chrono::steady_clock::time_point start,
+                        bool prefetch = false) {
+    auto req = new PendingRead;
+    req->pfh_args = pfh_args;
+    req->first_idx = first_idx;
+    req->count = count;
+    req->start = start;
+    req->prefetch = prefetch;
+    req->frames.assign(frames, frames + count);
+    req->iov.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        req->iov[i].iov_base = frames[i];
+        req->iov[i].iov_len = PAGE_SIZE;
+    }
+
+    pfh_args->inflight_reads++;
+    if (!io_rings[worker]->prep_readv(
+            pfh_args->fd, req->iov.data(), count,
+            pfh_args->offset + first_idx * PAGE_SIZE, (uint64_t)req)) {
+        pfh_args->inflight_reads--;
+        delete req;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * A read queued by submit_read() finished: map its pages and wake whoever
+ * waits on them. Reads complete in any order.
+ */
+static void complete_read(PendingRead *req, int res) {
+    PFhandle_args *pfh_args = req->pfh_args;
+    if (res < 0) {
+        errno = -res;
+        err(EXIT_FAILURE, "io_uring readv");
+    }
+    pfh_args->stats.bytes_read += res;
+    for (size_t i = res / PAGE_SIZE; i < req->count; i++) {
+        size_t valid = i == (size_t)res / PAGE_SIZE ? res % PAGE_SIZE : 0;
+        memset((char *)req->frames[i] + valid, 0, PAGE_SIZE - valid);
+    }
+
+    map_frames(pfh_args, req->first_idx, req->count, req->frames.data(),
+               (res + PAGE_SIZE - 1) / PAGE_SIZE);
+    wake_range(pfh_args,
+               (__u64)pfh_args->base_addr + req->first_idx * PAGE_SIZE,
+               req->count * PAGE_SIZE);
+    if (!req->prefetch)
+        pfh_args->stats.add_latency(nanos_since(req->start), 1);
+    delete req;
+    pfh_args->inflight_reads.fetch_sub(1, std::memory_order_release);
+}
+
+/**
+ * Map the 2MiB block around the claimed page_idx with a huge frame: fill it
+ * and install a PMD entry with the size bit, replacing the empty PT page the
+ * kernel allocated for the fault (kept to be restored by release_range()).
+ * Returns false if the block must use 4KiB pages: it is not entirely inside
+ * the region, some of its pages are mapped or claimed already, or huge_pool
+ * is empty. Otherwise *first_idx is the block's first page.
+ */
+static bool map_huge_block(PFhandle_args *pfh_args, size_t page_idx,
+                           size_t *first_idx_out) {
+    size_t base_pfn = (size_t)pfh_args->base_addr / PAGE_SIZE;
+    size_t block = pfh_args->block_index(page_idx);
+    size_t first_pfn = (pfh_args->first_block + block) * PAGES_PER_PT;
+    if (first_pfn < base_pfn ||
+        first_pfn + PAGES_PER_PT > base_pfn + pfh_args->num_pages)
+        return false;
+    if (pfh_args->block_resident[block].load(std::memory_order_relaxed) != 0)
+        return false;
+
+    size_t first_idx = first_pfn - base_pfn;
+    size_t claimed = 0;
+    while (claimed < PAGES_PER_PT &&
+           (first_idx + claimed == page_idx ||
+            claim_page(pfh_args, first_idx + claimed)))
+        claimed++;
+    void *frame = claimed == PAGES_PER_PT ? huge_pool->allocate() : nullptr;
+    if (frame == nullptr) {
+        // page_idx stays claimed for the 4KiB path
+        size_t below = std::min(claimed, page_idx - first_idx);
+        unclaim_pages(pfh_args, first_idx, below);
+        if (claimed > page_idx - first_idx + 1)
+            unclaim_pages(pfh_args, page_idx + 1,
+                          claimed - (page_idx - first_idx + 1));
+        return false;
+    }
+    void *frames[PAGES_PER_PT];
+    for (size_t i = 0; i < PAGES_PER_PT; i++) {
+        frames[i] = (char *)frame + i * PAGE_SIZE;
+    }
+    if (pfh_args->fd == -1) {
+        memset(frame, 0, HUGE_PAGE_SIZE);
+    } else {
+        fill_frames(pfh_args, first_idx, PAGES_PER_PT, frames);
+    }
+    void *address = (char *)pfh_args->base_addr + first_idx * PAGE_SIZE;
+    // ul_mprotect() refuses huge regions, their protection never changes;
+    // the block's dirty bit tracks its writes, it is never write-protected
+    pfh_args->huge_old_pmd[block] = pfh_args->backend->map_huge_page(
+        address, frame, pfh_args->prot.load(std::memory_order_relaxed));
+
+    pfh_args->huge_frames[block].store(frame, std::memory_order_release);
+    for (size_t i = 0; i < PAGES_PER_PT; i++) {
+        pfh_args->frames[first_idx + i].store(frames[i],
+                                              std::memory_order_release);
+    }
+    pfh_args->block_resident[block].store(PAGES_PER_PT,
+                                          std::memory_order_relaxed);
+    pfh_args->resident_pages += PAGES_PER_PT;
+    *first_idx_out = first_idx;
+    return true;
+}
+
+/**
+ * Map claimed anonymous pages [first_idx, first_idx + count) read-only to
+ * zeros, without frames. Returns false if the backend can't.
+ */
+static bool map_zero_run(PFhandle_args *pfh_args, size_t first_idx,
+                         size_t count) {
+    // only write-protected zeros report their first write
+    if (pfh_args->dirty && !pfh_args->backend->wp_zero_pages()) return false;
+    char *address = (char *)pfh_args->base_addr + first_idx * PAGE_SIZE;
+    int prot = pfh_args->prot.load(std::memory_order_seq_cst);
+    if (!pfh_args->backend->map_zero_readonly(pfh_args->uffd, address, count,
+                                              prot))
+        return false;
+    for (size_t i = first_idx; i < first_idx + count; i++) {
+        pfh_args->frames[i].store(FRAME_ZERO, std::memory_order_release);
+        pfh_args->block_of(i)++;
+    }
+    pfh_args->resident_pages += count;
+    recheck_protection(pfh_args, prot, first_idx, count);
+    return true;
+}
+
+/**
+ * The first write to a clean page of a dirty-tracked region: record it, then
+ * let it through. A write-back may take the bit and write-protect the page
+ * again meanwhile; the bit is set again then, so that a writable page is
+ * always marked.
+ */
+static void grant_write(PFhandle_args *pfh_args, size_t idx) {
+    int prot = pfh_args->prot.load(std::memory_order_seq_cst);
+    // handle_fault_msgs() signalled the writer
+    if (!(prot & PROT_WRITE)) return;
+    void *address = (char *)pfh_args->base_addr + idx * PAGE_SIZE;
+    pfh_args->set_dirty(idx);
+    pfh_args->backend->write_protect(pfh_args->uffd, &address, 1, false, prot);
+    pfh_args->backend->flush_tlb(&address, 1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!pfh_args->is_dirty(idx)) pfh_args->set_dirty(idx);
+    recheck_protection(pfh_args, prot, idx, 1);
+}
+
+/**
+ * A write-protect fault: the first write to an anonymous page mapped by
+ * map_zero_run(), which gets a zeroed frame of its own, or to a clean page
+ * of a dirty-tracked region.
+ */
+static PageRange handle_wp_page(PFhandle_args *pfh_args, __u64 page_addr) {
+    size_t page_idx = (page_addr - (__u64)pfh_args->base_addr) / PAGE_SIZE;
+    void *expected = FRAME_ZERO;
+    while (!pfh_args->frames[page_idx].compare_exchange_strong(
+        expected, FRAME_INFLIGHT, std::memory_order_acq_rel)) {
+        // pinned, until written back or dropped
+        if (expected == FRAME_EVICTING) {
+            std::this_thread::yield();
+            expected = FRAME_ZERO;
+            continue;
+        }
+        // being replaced by another handler, which wakes it
+        if (expected == FRAME_INFLIGHT) return {page_idx, 0};
+        if (pfh_args->dirty && is_frame(expected))
+            grant_write(pfh_args, page_idx);
+        return {page_idx, 1};
+    }
+    void *frame = take_frame(true, true);
+    void *address = (void *)page_addr;
+    int prot = pfh_args->prot.load(std::memory_order_seq_cst);
+    // mapped writable right away, the write is underway
+    if (pfh_args->dirty) pfh_args->set_dirty(page_idx);
+    pfh_args->backend->map_pages(pfh_args->uffd, address, &frame, 1, prot);
+    // other CPUs may still read the zeros through a stale entry
+    pfh_args->backend->flush_tlb(&address, 1);
+    pfh_args->frames[page_idx].store(frame, std::memory_order_release);
+    recheck_protection(pfh_args, prot, page_idx, 1);
+    return {page_idx, 1};
+}
+
+/**
+ * Whether the page idx, which the frame table records as resident, is gone
+ * from under a backend that copies the frames: the kernel's page was freed
+ * (MADV_DONTNEED) behind the frame table. mincore() tells it apart from a
+ * page the window of another fault mapped after this fault was raised. The
+ * page tables of backends that map the frames only change with the table.
+ */
+static bool page_dropped(PFhandle_args *pfh_args, size_t idx) {
+    if (pfh_args->backend->maps_frames()) return false;
+    unsigned char vec;
+    void *address = (char *)pfh_args->base_addr + idx * PAGE_SIZE;
+    return mincore(address, PAGE_SIZE, &vec) == 0 && !(vec & 1);
+}
 
-    long uffd = 0;  // need to get events from uffd
-    int fd = -1;    // for file backed up mmap
-    off_t offset = 0;
-    void *base_addr = NULL;  // mmap base address
+/**
+ * Populate a missing page of the region together with the untouched pages of
+ * its fault-around window: claim them, take frames from page_pool, fill them
+ * from the backing file (zeros for anonymous mappings), and map them. Read
+ * faults on anonymous mappings map the run to zeros without frames.
+ *
+ * Returns the pages whose waiters the caller must wake: the mapped run, the
+ * page itself if it is resident already, or nothing if another handler owns
+ * it or its content is read through io_uring (complete_read() wakes then).
+ * A page recorded as resident whose kernel page is gone is populated again.
+ */
+static PageRange handle_missing_page(
+    PFhandle_args *pfh_args, __u64 page_addr, bool write, size_t worker,
+    std::chrono::steady_clock::time_point start) {
+    size_t page_idx = (page_addr - (__u64)pfh_args->base_addr) / PAGE_SIZE;
+    void *frame = nullptr;
+    while (!pfh_args->frames[page_idx].compare_exchange_weak(
+        frame, FRAME_INFLIGHT, std::memory_order_acq_rel,
+        std::memory_order_acquire)) {
+        // being populated by another handler, which wakes it
+        if (frame == FRAME_INFLIGHT) return {page_idx, 0};
+        if (frame == FRAME_EVICTING) {
+            std::this_thread::yield();
+            frame = nullptr;
+            continue;
+        }
+        // already populated by the window of an earlier fault
+        if (!page_dropped(pfh_args, page_idx)) return {page_idx, 1};
+        // stale, waking would only fault again: populate it anew
+        if (pfh_args->frames[page_idx].compare_exchange_strong(
+                frame, FRAME_INFLIGHT, std::memory_order_acq_rel)) {
+            pfh_args->block_of(page_idx)--;
+            pfh_args->resident_pages--;
+            break;
+        }
+        frame = nullptr;
+    }
 
-    std::thread thread;
-    bool finish = false;
+    size_t block_idx;
+    if (pfh_args->huge_frames && huge_pool != nullptr &&
+        map_huge_block(pfh_args, page_idx, &block_idx))
+        return {block_idx, PAGES_PER_PT};
 
-    /*statistics*/
-    int fault_cnt = 0;
-};
+    size_t first, last;
+    fault_around_window(pfh_args, page_idx, &first, &last);
 
-std::mutex mmap_regions_mu;
-std::unordered_map<void *, std::shared_ptr<PFhandle_args>> mmap_regions;
+    // the run of missing pages around page_idx
+    size_t run_first = page_idx, run_last = page_idx + 1;
+    while (run_first > first && claim_page(pfh_args, run_first - 1))
+        run_first--;
+    while (run_last < last && claim_page(pfh_args, run_last)) run_last++;
 
-static void page_fault_handler(std::shared_ptr<PFhandle_args> pfh_args) {
-    int nready;
-    ssize_t nread;
-    struct pollfd pollfd;
-    // struct uffdio_copy uffdio_copy;
-    struct uffdio_range uffdio_range;
-    static struct uffd_msg msg; /* Data read from userfaultfd */
+    if (pfh_args->fd == -1 && !write &&
+        map_zero_run(pfh_args, run_first, run_last - run_first)) {
+        return {run_first, run_last - run_first};
+    }
 
-    long uffd = pfh_args->uffd; /* userfaultfd file descriptor */
+    void *given_pages[MAX_FAULT_AROUND_PAGES];
+    given_pages[page_idx - run_first] = page_frame(pfh_args, page_idx, true);
+    // neighbours are best effort, trim the run where the pool runs dry
+    for (size_t i = page_idx; i-- > run_first;) {
+        given_pages[i - run_first] = page_frame(pfh_args, i, false);
+        if (given_pages[i - run_first] == nullptr) {
+            std::copy(given_pages + (i + 1 - run_first),
+                      given_pages + (page_idx + 1 - run_first), given_pages);
+            unclaim_pages(pfh_args, run_first, i + 1 - run_first);
+            run_first = i + 1;
+            break;
+        }
+    }
+    for (size_t i = page_idx + 1; i < run_last; i++) {
+        given_pages[i - run_first] = page_frame(pfh_args, i, false);
+        if (given_pages[i - run_first] == nullptr) {
+            unclaim_pages(pfh_args, i, run_last - i);
+            run_last = i;
+            break;
+        }
+    }
 
-    /* Loop, handling incoming events on the userfaultfd
-       file descriptor. */
+    size_t count = run_last - run_first;
+    if (pfh_args->fd != -1 && !io_rings.empty() &&
+        submit_read(pfh_args, worker, run_first, count, given_pages, start)) {
+        return {page_idx, 0};
+    }
 
-    for (;;) {
-        /* See what poll() tells us about the userfaultfd. */
+    size_t nr_data = fill_frames(pfh_args, run_first, count, given_pages);
+    map_frames(pfh_args, run_first, count, given_pages, nr_data);
+    // spare the faulting write a write-protect fault
+    if (write && pfh_args->dirty) grant_write(pfh_args, page_idx);
+    return {run_first, count};
+}
 
-        pollfd.fd = uffd;
-        pollfd.events = POLLIN;
-        nready = poll(&pollfd, 1, -1);
-        if (nready == -1) err(EXIT_FAILURE, "poll");
+/**
+ * A minor fault on a shmem-backed region: the page is in the page cache
+ * already, written through another mapping of the memfd or mapped before
+ * and its PTE zapped since. Map it as it is, without filling it.
+ */
+static PageRange handle_minor_page(PFhandle_args *pfh_args, __u64 page_addr) {
+    size_t page_idx = (page_addr - (__u64)pfh_args->base_addr) / PAGE_SIZE;
+    void *frame = pfh_args->alias + page_idx * PAGE_SIZE;
+    // pinned: wait until written back, or until dropped from the memfd,
+    // the page then faults again as missing
+    bool pinned = false;
+    while (pfh_args->frames[page_idx].load(std::memory_order_acquire) ==
+           FRAME_EVICTING) {
+        pinned = true;
+        std::this_thread::yield();
+    }
+    if (pinned &&
+        pfh_args->frames[page_idx].load(std::memory_order_acquire) == nullptr)
+        return {page_idx, 1};
+    if (claim_page(pfh_args, page_idx)) {
+        map_frames(pfh_args, page_idx, 1, &frame, 1);
+        return {page_idx, 1};
+    }
+    // being populated by another handler, which wakes it
+    if (pfh_args->frames[page_idx].load(std::memory_order_acquire) ==
+        FRAME_INFLIGHT)
+        return {page_idx, 0};
+    pfh_args->backend->map_pages(
+        pfh_args->uffd, (void *)page_addr, &frame, 1,
+        map_prot(pfh_args, pfh_args->prot.load(std::memory_order_relaxed)));
+    return {page_idx, 1};
+}
 
-        /*
-        printf("\nfault_handler_thread():\n");
-        printf(
-            "    poll() returns: nready = %d; "
-            "POLLIN = %d; POLLERR = %d\n",
-            nready, (pollfd.revents & POLLIN) != 0,
-            (pollfd.revents & POLLERR) != 0);
-        */
+/**
+ * Unmap the resident pages in [first_idx, last_idx) of the region, write the
+ * dirty ones of a shared file-backed region back, and give the frames back
+ * to page_pool. The PTEs must be gone before the kernel munmap()s the range,
+ * it would otherwise drop references to pages it never handed out.
+ *
+ * The pages are pinned first, and the frame table entries only cleared once
+ * the pages are gone. Pages that are pinned or being populated meanwhile are
+ * skipped. With drop, the kernel's pages of a backend that copies the frames
+ * are freed as well, otherwise munmap() takes them.
+ *
+ * Returns 0, or -1 with errno set if a write-back failed; the pages are
+ * released all the same, their content is lost like the kernel loses that
+ * of pages whose write-back fails.
+ */
+static int release_range(PFhandle_args *pfh_args, size_t first_idx,
+                         size_t last_idx, bool drop) {
+    FaultBackend *backend = pfh_args->backend;
+    bool write = pfh_args->fd != -1 && pfh_args->shared;
+    std::vector<PinnedPage> pinned, dirty;
+    std::vector<void *> addresses;
+    for_each_resident(pfh_args, first_idx, last_idx, [&](size_t idx,
+                                                          void *frame) {
+        if (!pin_page(pfh_args, idx, frame)) return;
+        pinned.push_back({idx, frame});
+        bool marked = pfh_args->dirty && pfh_args->take_dirty(idx);
+        if (!backend->maps_frames()) {
+            // the kernel's pages go away with the VMA, their flags are
+            // unknown unless the region is dirty-tracked
+            if (write && (!pfh_args->dirty || marked))
+                dirty.push_back({idx, frame});
+            return;
+        }
+        void *address = (char *)pfh_args->base_addr + idx * PAGE_SIZE;
+        int flags = backend->unmap_page(address, false);
+        if (write && ((flags & FaultBackend::PAGE_DIRTY) || marked))
+            dirty.push_back({idx, frame});
+        addresses.push_back(address);
+    });
+    // the content is final only once no TLB maps it anymore
+    backend->flush_tlb(addresses.data(), addresses.size());
+    int error = write_back_pages(pfh_args, dirty) == -1 ? errno : 0;
 
-        /* Read an event from the userfaultfd. */
+    // only the pinned runs: a page populated meanwhile stays mapped
+    for (size_t i = 0; drop && !backend->maps_frames() && i < pinned.size();) {
+        size_t j = i + 1;
+        while (j < pinned.size() && pinned[j].idx == pinned[i].idx + (j - i))
+            j++;
+        backend->drop_pages(
+            (char *)pfh_args->base_addr + pinned[i].idx * PAGE_SIZE,
+            (j - i) * PAGE_SIZE);
+        i = j;
+    }
 
-        nread = read(uffd, &msg, sizeof(msg));
-        if (nread == 0) {
-            printf("EOF on userfaultfd!\n");
-            exit(EXIT_FAILURE);
+    for (auto &page : pinned) {
+        if (backend->maps_frames() && page.frame != FRAME_ZERO)
+            page_pool->deallocate(page.frame);
+        pfh_args->block_of(page.idx)--;
+        pfh_args->resident_pages--;
+        pfh_args->frames[page.idx].store(nullptr, std::memory_order_release);
+    }
+
+    for_each_huge_block(
+        pfh_args, first_idx, last_idx, [&](size_t block_idx, void *frame) {
+            // the block is pinned through its first page
+            if (!pin_page(pfh_args, block_idx, frame)) return;
+            size_t block = pfh_args->block_index(block_idx);
+            void *address = (char *)pfh_args->base_addr + block_idx * PAGE_SIZE;
+            // put the kernel's PT page back, this also flushes the TLB
+            bool dirty = backend->unmap_huge_page(
+                             address, pfh_args->huge_old_pmd[block]) &
+                         FaultBackend::PAGE_DIRTY;
+
+            if (write && dirty) {
+                std::vector<PinnedPage> pages(PAGES_PER_PT);
+                for (size_t i = 0; i < PAGES_PER_PT; i++)
+                    pages[i] = {block_idx + i, (char *)frame + i * PAGE_SIZE};
+                if (write_back_pages(pfh_args, pages) == -1 && error == 0)
+                    error = errno;
+            }
+            for (size_t i = 0; i < PAGES_PER_PT; i++) {
+                pfh_args->frames[block_idx + i].store(nullptr,
+                                                      std::memory_order_relaxed);
+            }
+            pfh_args->huge_frames[block].store(nullptr,
+                                               std::memory_order_relaxed);
+            pfh_args->block_resident[block].store(0, std::memory_order_relaxed);
+            pfh_args->resident_pages -= PAGES_PER_PT;
+            huge_pool->deallocate(frame);
+        });
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Release all resident pages of a region that no handler serves anymore.
+ * Regions with many resident pages are split into PT-aligned parts that
+ * are released in parallel. Returns like release_range().
+ */
+static int release_frames(PFhandle_args *pfh_args) {
+    size_t resident = pfh_args->resident_pages.load();
+    size_t nthreads =
+        std::min(handler_pool->num_workers(),
+                 resident / PARALLEL_RELEASE_PAGES + 1);
+    if (nthreads <= 1)
+        return release_range(pfh_args, 0, pfh_args->num_pages, false);
+
+    // parts are whole PT pages, a huge block must not be split
+    size_t base_pfn = (size_t)pfh_args->base_addr / PAGE_SIZE;
+    auto part_start = [&](size_t part) {
+        size_t block = (pfh_args->num_blocks + nthreads - 1) / nthreads * part;
+        size_t pfn = (pfh_args->first_block + block) * PAGES_PER_PT;
+        return std::min(std::max(pfn, base_pfn) - base_pfn,
+                        pfh_args->num_pages);
+    };
+    // errno of each part, 0 if it succeeded
+    std::vector<int> errors(nthreads, 0);
+    auto release_part = [&](size_t part) {
+        if (release_range(pfh_args, part_start(part), part_start(part + 1),
+                          false) == -1)
+            errors[part] = errno;
+    };
+    std::vector<std::thread> threads;
+    for (size_t part = 1; part < nthreads; part++) {
+        threads.emplace_back(release_part, part);
+    }
+    release_part(0);
+    for (auto &thread : threads) thread.join();
+    for (int error : errors) {
+        if (error != 0) {
+            errno = error;
+            return -1;
         }
+    }
+    return 0;
+}
 
-        if (nread == -1) err(EXIT_FAILURE, "read");
+/**
+ * Resolve a batch of messages read from the region's uffd.
+ *
+ * The faulting pages are sorted and deduplicated (several threads may wait
+ * on the same page), all of them are mapped, and then the waiters are woken
+ * with one UFFDIO_WAKE per run of adjacent pages. Pages whose content is read
+ * through io_uring are woken when their read completes instead, pages
+ * claimed by another handler by that handler.
+ */
+static void handle_fault_msgs(PFhandle_args *pfh_args,
+                              const struct uffd_msg *msgs, size_t nmsgs,
+                              size_t worker) {
+    thread_local std::vector<__u64> pages;
+    thread_local std::vector<PageRange> wake;
+    auto start = std::chrono::steady_clock::now();
+    size_t served = 0;
 
+    pages.clear();
+    wake.clear();
+    for (size_t i = 0; i < nmsgs; i++) {
         /* We expect only one kind of event; verify that assumption. */
-
-        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+        if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
             fprintf(stderr, "Unexpected event on userfaultfd\n");
             exit(EXIT_FAILURE);
         }
+        /* We need to handle page faults in units of pages(!).
+            So, round faulting address down to page boundary. */
+        __u64 page = msgs[i].arg.pagefault.address & ~(__u64)(PAGE_SIZE - 1);
+        __u64 flags = msgs[i].arg.pagefault.flags;
+        // a write to a region ul_mprotect() made read-only: signal the
+        // writer like the kernel would, and serve the fault as a read
+        if ((flags & (UFFD_PAGEFAULT_FLAG_WRITE | UFFD_PAGEFAULT_FLAG_WP)) &&
+            pfh_args->backend->maps_frames() &&
+            !(pfh_args->prot.load(std::memory_order_relaxed) & PROT_WRITE)) {
+            syscall(SYS_tgkill, getpid(), msgs[i].arg.pagefault.feat.ptid,
+                    SIGSEGV);
+            flags &= ~(__u64)(UFFD_PAGEFAULT_FLAG_WRITE |
+                              UFFD_PAGEFAULT_FLAG_WP);
+        }
+        if (flags & UFFD_PAGEFAULT_FLAG_MINOR) page |= FAULT_MINOR;
+        if (flags & UFFD_PAGEFAULT_FLAG_WRITE) page |= FAULT_WRITE;
+        if (flags & UFFD_PAGEFAULT_FLAG_WP) page |= FAULT_WP;
+        pages.push_back(page);
+    }
+    std::sort(pages.begin(), pages.end());
+    // one entry per page, with the kinds of all of its faults
+    const __u64 page_mask = ~(__u64)(PAGE_SIZE - 1);
+    size_t npages = 0;
+    for (__u64 page : pages) {
+        if (npages > 0 && (pages[npages - 1] & page_mask) == (page & page_mask))
+            pages[npages - 1] |= page;
+        else
+            pages[npages++] = page;
+    }
+    pages.resize(npages);
+
+    // keep the pages mapped right away, in order
+    for (__u64 page : pages) {
+        __u64 page_addr = page & page_mask;
+        PageRange range;
+        if (page & FAULT_MINOR) {
+            range = handle_minor_page(pfh_args, page_addr);
+        } else if (page & FAULT_WP) {
+            range = handle_wp_page(pfh_args, page_addr);
+        } else {
+            range = handle_missing_page(pfh_args, page_addr,
+                                        page & FAULT_WRITE, worker, start);
+        }
+        if (range.count > 0) {
+            wake.push_back(range);
+            served++;
+        }
+        if (page & (FAULT_WRITE | FAULT_WP)) {
+            pfh_args->stats.write_faults++;
+        } else {
+            pfh_args->stats.read_faults++;
+        }
+    }
+    pfh_args->stats.faults += npages;
+    if (!io_rings.empty()) io_rings[worker]->submit();
+
+    // ranges come in address order, merge the adjacent ones
+    for (size_t i = 0; i < wake.size();) {
+        size_t first = wake[i].first_idx;
+        size_t last = first + wake[i].count;
+        size_t j = i + 1;
+        for (; j < wake.size() && wake[j].first_idx <= last; j++) {
+            last = std::max(last, wake[j].first_idx + wake[j].count);
+        }
+        wake_range(pfh_args, (__u64)pfh_args->base_addr + first * PAGE_SIZE,
+                   (last - first) * PAGE_SIZE);
+        i = j;
+    }
+    // faults read through io_uring are counted when their read completes
+    if (served > 0) pfh_args->stats.add_latency(nanos_since(start), served);
+}
+
+/**
+ * Handle all page faults currently queued on the region's uffd.
+ * Called by a handler_pool worker whenever the uffd becomes readable.
+ * Up to fault_batch messages are drained per read().
+ */
+static void page_fault_handler(PFhandle_args *pfh_args, size_t worker) {
+    thread_local std::vector<struct uffd_msg> msgs;
+
+    long uffd = pfh_args->uffd; /* userfaultfd file descriptor */
+    msgs.resize(engine_config.fault_batch);
+
+    /* Loop, handling incoming events on the userfaultfd
+       file descriptor, until it is drained. */
+
+    for (;;) {
+        ssize_t nread = read(uffd, msgs.data(), msgs.size() * sizeof(msgs[0]));
+        if (nread == 0) {
+            printf("EOF on userfaultfd!\n");
+            exit(EXIT_FAILURE);
+        }
 
-        /* Display info about the page-fault event. */
+        if (nread == -1) {
+            // drained, or another worker got the event first
+            if (errno == EAGAIN) return;
+            err(EXIT_FAILURE, "read");
+        }
+
+        size_t nmsgs = nread / sizeof(msgs[0]);
+        handle_fault_msgs(pfh_args, msgs.data(), nmsgs, worker);
+
+        // a short read means the queue is empty
+        if (nmsgs < msgs.size()) return;
+    }
+}
 
-        /*
-        printf("    UFFD_EVENT_PAGEFAULT event: ");
-        printf("flags = %llx; ", msg.arg.pagefault.flags);
-        printf("address = %llx\n", msg.arg.pagefault.address);
-        */
+/*
+ * sqpoll mode: the uffd of a file-backed region is read through the same
+ * io_uring as its file, tagged by the region address | 1. Without syscalls
+ * as long as the kernel's submission thread is awake.
+ */
+static bool arm_ring_read(PFhandle_args *pfh_args) {
+    return io_rings[pfh_args->ring]->prep_read(
+        pfh_args->uffd, pfh_args->ring_msgs.data(),
+        pfh_args->ring_msgs.size() * sizeof(struct uffd_msg), 0,
+        (uint64_t)pfh_args | 1);
+}
 
-        /* Copy the page pointed to by 'page' into the faulting
-           region. Vary the contents that are copied in, so that it
-           is more obvious that each fault is handled separately. */
+static void complete_ring_read(PFhandle_args *pfh_args, int res,
+                               size_t worker) {
+    if (res > 0) {
+        handle_fault_msgs(pfh_args, pfh_args->ring_msgs.data(),
+                          res / sizeof(struct uffd_msg), worker);
+    } else if (res != -ECANCELED && res != -EAGAIN && res != -EINTR) {
+        errno = -res;
+        err(EXIT_FAILURE, "io_uring read of userfaultfd");
+    }
 
-        void *given_page = malloc(PAGE_SIZE);
-        assert(given_page != nullptr);
+    if (res == -ECANCELED ||
+        pfh_args->ring_closing.load(std::memory_order_acquire) ||
+        !arm_ring_read(pfh_args)) {
+        pfh_args->ring_read_done.store(true, std::memory_order_release);
+    }
+}
 
-        if (pfh_args->fd == -1) {
-            memset(given_page, 'A' + pfh_args->fault_cnt % 26, PAGE_SIZE);
+/**
+ * Called by handler_pool when the io_uring of a worker has completions.
+ */
+static void reap_io_ring(size_t worker) {
+    IoUring *ring = io_rings[worker];
+    ring->reap([worker](uint64_t user_data, int res) {
+        if (user_data == 0) return;  // cancellation request
+        if (user_data & 1) {
+            complete_ring_read((PFhandle_args *)(user_data & ~1ull), res,
+                               worker);
         } else {
-            auto region_offset =
-                msg.arg.pagefault.address - (__u64)pfh_args->base_addr;
-            auto bytes_read = pread(pfh_args->fd, given_page, PAGE_SIZE,
-                                    pfh_args->offset + region_offset);
-            assert(bytes_read == PAGE_SIZE);
-        }
-        pfh_args->fault_cnt++;
-
-        // 1. get the pfd of given_page
-        size_t given_page_pfn = ptedit_pte_get_pfn(given_page, 0);
-        // debug: print given_page
-        // {
-        //     ptedit_entry_t given_page_vm = ptedit_resolve((void *)given_page,
-        //     0); ptedit_print_entry_t(given_page_vm); printf(TAG_PROGRESS
-        //     "given page vm %zx\n", (size_t)(ptedit_cast(given_page_vm.pte,
-        //     ptedit_pte_t).pfn));
-        // }
-        // 2. get the ptedit_entry of fault address
-        ptedit_entry_t vm =
-            ptedit_resolve((void *)msg.arg.pagefault.address, 0);
-        // debug:print page fault address
-        // {
-        //     ptedit_print_entry_t(vm);
-        //     printf(TAG_PROGRESS "fault address %zx\n",
-        //     (size_t)(ptedit_cast(vm.pte, ptedit_pte_t).pfn));
-        // }
-        // 3. update to pfn of fault address, and set valid bit, and update
-        vm.pte = ptedit_set_pfn(vm.pte, given_page_pfn);
-        vm.pte = ptedit_pte_entry_set_bit(vm.pte, PTEDIT_PAGE_BIT_PRESENT);
-        vm.pte = ptedit_pte_entry_set_bit(vm.pte, PTEDIT_PAGE_BIT_RW);
-        vm.pte = ptedit_pte_entry_set_bit(vm.pte, PTEDIT_PAGE_BIT_USER);
-        vm.valid = PTEDIT_VALID_MASK_PTE;
-        ptedit_update((void *)msg.arg.pagefault.address, 0, &vm);
-
-        // debug: print updated page fault address
-        // {
-        //     ptedit_entry_t vm = ptedit_resolve(msg.arg.pagefault.address, 0);
-        //     ptedit_print_entry_t(vm);
-        //     printf(TAG_PROGRESS "updated fault address %zx\n",
-        //     (size_t)(ptedit_cast(vm.pte, ptedit_pte_t).pfn));
-        // }
-
-        // debug: try to access the page
-        /*
-        {
-            char ch = *(char *)(msg.arg.pagefault.address);
-            printf(TAG_PROGRESS "Try to access page fault address: %c\n", ch);
+            complete_read((PendingRead *)user_data, res);
         }
-        */
+    });
+    // requests queued while handling the completions
+    ring->submit();
+}
 
-        /* We need to handle page faults in units of pages(!).
-            So, round faulting address down to page boundary. */
-        uffdio_range.start =
-            (unsigned long)msg.arg.pagefault.address & ~(PAGE_SIZE - 1);
-        uffdio_range.len = PAGE_SIZE;
-        if (ioctl(uffd, UFFDIO_WAKE, &uffdio_range) == -1)
-            err(EXIT_FAILURE, "ioctl-UFFDIO_WAKE");
+/**
+ * Stop resolving faults of the region and wait until no handler touches it.
+ */
+static void stop_fault_handling(PFhandle_args *pfh_args) {
+    // a prefetch may still claim pages, its reads are waited for below
+    pfh_args->unmapping.store(true, std::memory_order_release);
+    while (pfh_args->prefetches.load(std::memory_order_acquire) != 0) {
+        std::this_thread::yield();
+    }
+
+    if (pfh_args->ring >= 0) {
+        IoUring *ring = io_rings[pfh_args->ring];
+        pfh_args->ring_closing.store(true, std::memory_order_release);
+        // retried: the read may get re-armed right before ring_closing is seen
+        while (!pfh_args->ring_read_done.load(std::memory_order_acquire)) {
+            if (ring->prep_cancel((uint64_t)pfh_args | 1, 0)) ring->submit();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    } else {
+        handler_pool->remove(pfh_args->pool_handle);
+    }
 
-        // printf("       uffdio_wake returned\n");
+    while (pfh_args->inflight_reads.load(std::memory_order_acquire) != 0) {
+        std::this_thread::yield();
     }
 }
 
 /**
- * use kernel's mmap implementation to reserve vm area.
- * then, use userfaultfd to delegate page fault handle to user space.
+ * The region that contains [addr, addr + length), nullptr if the range is
+ * not entirely within one region.
  */
-void *ul_mmap(void *addr, size_t length, int prot, int flags, int fd,
-              off_t offset) {
-    static bool pteditor_init_flag = false;
-    if (pteditor_init_flag == false) {
-        // FIXME(Priority: Low): race condition: may lead to leak of ptedit_fd
-        /*init PTEditor*/
-        if (ptedit_init()) {
-            printf(
-                "Error: Could not initalize PTEditor, did you load the kernel "
-                "module?\n");
-            exit(1);
+static std::shared_ptr<PFhandle_args> find_region(void *addr, size_t length) {
+    std::lock_guard<std::mutex> guard(mmap_regions_mu);
+    auto it = mmap_regions.upper_bound(addr);
+    if (it == mmap_regions.begin()) return nullptr;
+    --it;
+    PFhandle_args *pfh_args = it->second.get();
+    if ((char *)addr + length > (char *)pfh_args->base_addr + pfh_args->length)
+        return nullptr;
+    return it->second;
+}
+
+/**
+ * Open a private file description of a file-backed region. With
+ * ul_config.direct_io the file is reopened with O_DIRECT, its frames are
+ * pool pages and thus satisfy the alignment of direct I/O. O_DIRECT can't
+ * be set on a dup() of fd: the flag would be shared with the caller.
+ */
+static int open_backing_file(int fd, bool *direct_io) {
+    *direct_io = false;
+    if (engine_config.direct_io) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags == -1) err(EXIT_FAILURE, "fcntl-F_GETFL");
+
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        int direct_fd =
+            open(path, (flags & O_ACCMODE) | O_DIRECT | O_CLOEXEC);
+        if (direct_fd != -1) {
+            *direct_io = true;
+            return direct_fd;
         }
+        fprintf(stderr,
+                "Warning: can't open fd %d with O_DIRECT (%s), reading it "
+                "through the page cache\n",
+                fd, strerror(errno));
+    }
 
-        ptedit_use_implementation(PTEDIT_IMPL_USER);
-        pteditor_init_flag = true;
+    int dup_fd = dup(fd);
+    if (dup_fd < 0) {
+        printf("Failed to duplicate fd\n");
+        exit(1);
     }
+    return dup_fd;
+}
 
-    PAGE_SIZE = sysconf(_SC_PAGE_SIZE);
+/**
+ * use kernel's mmap implementation to reserve vm area.
+ * then, use userfaultfd to delegate page fault handle to user space.
+ */
+static void *map_region(void *addr, size_t length, int prot, int flags, int fd,
+                        off_t offset, FaultBackend *backend) {
     /* 1. alloc vm area by anonymous mmap syscall */
-    addr = mmap(addr, length, prot, MAP_ANONYMOUS | MAP_PRIVATE, -1, offset);
-    if (addr == MAP_FAILED) err(EXIT_FAILURE, "mmap");
+    int memfd = -1;
+    char *alias = nullptr;
+    bool huge = (flags & MAP_HUGETLB) && huge_pool != nullptr &&
+                backend->supports_huge();
+    if (huge && addr == NULL) {
+        // reserve a 2MiB aligned area, so that every block can be huge
+        size_t reserve = length + HUGE_PAGE_SIZE - PAGE_SIZE;
+        char *area = (char *)mmap(NULL, reserve, prot,
+                                  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (area == MAP_FAILED) err(EXIT_FAILURE, "mmap");
+        char *aligned = (char *)(((size_t)area + HUGE_PAGE_SIZE - 1) &
+                                 ~(HUGE_PAGE_SIZE - 1));
+        if (aligned > area) munmap(area, aligned - area);
+        if (area + reserve > aligned + length)
+            munmap(aligned + length, area + reserve - (aligned + length));
+        addr = aligned;
+    } else if (backend->shmem_backed()) {
+        memfd = memfd_create("ul_mmap", MFD_CLOEXEC);
+        if (memfd == -1) err(EXIT_FAILURE, "memfd_create");
+        if (ftruncate(memfd, length) == -1) err(EXIT_FAILURE, "ftruncate");
+        addr = mmap(addr, length, prot, MAP_SHARED, memfd, 0);
+        if (addr == MAP_FAILED) err(EXIT_FAILURE, "mmap");
+        // not registered with the uffd, writes fill the page cache
+        alias = (char *)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             memfd, 0);
+        if (alias == MAP_FAILED) err(EXIT_FAILURE, "mmap");
+    } else {
+        addr = mmap(addr, length, prot, MAP_ANONYMOUS | MAP_PRIVATE, -1,
+                    offset);
+        if (addr == MAP_FAILED) err(EXIT_FAILURE, "mmap");
+    }
+    // we map huge pages ourselves: the kernel must allocate a PT page for
+    // every fault, and khugepaged must not collapse our pages
+    madvise(addr, length, MADV_NOHUGEPAGE);
 
     /* 2. make vm area's page-faults handled by user level: register userfaultfd
      */
     /* Create and enable userfaultfd object. */
-    pthread_t thr; /* ID of thread that handles page faults */
     struct uffdio_api uffdio_api;
     struct uffdio_register uffdio_register;
 
-    const long uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    // in sqpoll mode, io_uring must not see EAGAIN but wait for faults
+    bool ring_read = fd != -1 && !io_rings.empty() &&
+                     engine_config.io_uring_sqpoll;
+    const long uffd = syscall(SYS_userfaultfd,
+                              O_CLOEXEC | (ring_read ? 0 : O_NONBLOCK));
     if (uffd == -1) err(EXIT_FAILURE, "userfaultfd");
 
     uffdio_api.api = UFFD_API;
-    uffdio_api.features = 0;
+    uffdio_api.features = backend->uffd_features();
     if (ioctl(uffd, UFFDIO_API, &uffdio_api) == -1)
         err(EXIT_FAILURE, "ioctl-UFFDIO_API");
 
@@ -221,56 +1810,644 @@ void *ul_mmap(void *addr, size_t length, int prot, int flags, int fd,
 
     uffdio_register.range.start = (unsigned long)addr;
     uffdio_register.range.len = length;
-    uffdio_register.mode = UFFDIO_REGISTER_MODE_MISSING;
+    uffdio_register.mode = backend->register_mode();
+    // writes to the zeros of anonymous read faults, to the pages of regions
+    // ul_mprotect() made read-only, and first writes of tracked pages
+    bool track_dirty =
+        engine_config.wp_dirty_tracking && backend->supports_wp_tracking();
+    if (backend->wp_zero_pages() || track_dirty)
+        uffdio_register.mode |= UFFDIO_REGISTER_MODE_WP;
+    // may still fault the range in through the kernel
+    backend->register_region(addr, length);
     if (ioctl(uffd, UFFDIO_REGISTER, &uffdio_register) == -1)
         err(EXIT_FAILURE, "ioctl-UFFDIO_REGISTER");
 
-    /* Create a thread that will process the userfaultfd events. */
+    /* Hand the userfaultfd over to the shared handler pool. */
 
-    int dup_fd = -1;
+    int file_fd = -1;
+    bool direct_io = false;
+    if (fd != -1) file_fd = open_backing_file(fd, &direct_io);
+    auto pfh_args =
+        std::make_shared<PFhandle_args>(uffd, file_fd, offset, addr, length);
+    pfh_args->direct_io = direct_io;
+    pfh_args->shared = (flags & MAP_SHARED) != 0;
+    pfh_args->prot = prot;
+    pfh_args->backend = backend;
+    if (track_dirty)
+        pfh_args->dirty.reset(
+            new std::atomic<uint64_t>[(pfh_args->num_pages + 63) / 64]());
+    pfh_args->memfd = memfd;
+    pfh_args->alias = alias;
+    if (huge) {
+        pfh_args->huge_frames.reset(
+            new std::atomic<void *>[pfh_args->num_blocks]());
+        pfh_args->huge_old_pmd.reset(new size_t[pfh_args->num_blocks]());
+    }
     if (fd != -1) {
-        dup_fd = dup(fd);
-        if (dup_fd < 0) {
-            printf("Failed to duplicate fd\n");
-            exit(1);
-        }
+        pfh_args->tail_fd = direct_io ? dup(fd) : file_fd;
+        if (pfh_args->tail_fd < 0) err(EXIT_FAILURE, "dup");
     }
-    auto pfh_args = std::make_shared<PFhandle_args>(uffd, dup_fd, offset, addr);
-    std::thread thread(page_fault_handler, pfh_args);
-    pfh_args->thread = std::move(thread);
 
     std::lock_guard<std::mutex> guard(mmap_regions_mu);
     mmap_regions[addr] = pfh_args;
+    // the kernel's pages of copying backends can't be evicted
+    if (fd != -1 && backend->maps_frames()) {
+        std::lock_guard<std::mutex> evict_guard(evict_mu);
+        evict_regions.push_back(pfh_args.get());
+    }
+
+    if (ring_read) {
+        pfh_args->ring = next_ring++ % io_rings.size();
+        pfh_args->ring_msgs.resize(engine_config.fault_batch);
+        if (!arm_ring_read(pfh_args.get()))
+            errx(EXIT_FAILURE, "io_uring submission queue full");
+        io_rings[pfh_args->ring]->submit();
+    } else {
+        pfh_args->pool_handle = handler_pool->add(
+            uffd,
+            [pfh_args](size_t worker) {
+                page_fault_handler(pfh_args.get(), worker);
+            },
+            -1, engine_config.handlers_per_region);
+    }
 
     return addr;
 }
 
-// FIXME
+void *ul_mmap(void *addr, size_t length, int prot, int flags, int fd,
+              off_t offset) {
+    if (!ensure_engine()) return MAP_FAILED;
+    FaultBackend *backend = default_backend;
+    if (!backend->supports_region(prot, fd != -1)) backend = uffd_copy_backend;
+    return map_region(addr, length, prot, flags, fd, offset, backend);
+}
+
+void *ul_mmap_backend(void *addr, size_t length, int prot, int flags, int fd,
+                      off_t offset, enum ul_backend backend) {
+    if (!ensure_engine()) return MAP_FAILED;
+    FaultBackend *fault_backend = default_backend;
+    if (!fault_backend->supports_region(prot, fd != -1))
+        fault_backend = uffd_copy_backend;
+    if (backend == UL_BACKEND_PTEDIT) {
+        // only probed at init if it may be needed
+        if (ptedit_backend == nullptr) {
+            errno = ENODEV;
+            return MAP_FAILED;
+        }
+        fault_backend = ptedit_backend;
+    } else if (backend == UL_BACKEND_UFFD_COPY) {
+        fault_backend = uffd_copy_backend;
+    } else if (backend == UL_BACKEND_UFFD_MOVE) {
+        if (uffd_move_backend == nullptr) {
+            errno = ENODEV;
+            return MAP_FAILED;
+        }
+        fault_backend = uffd_move_backend;
+    } else if (backend == UL_BACKEND_UFFD_MINOR) {
+        if (uffd_minor_backend == nullptr) {
+            errno = ENODEV;
+            return MAP_FAILED;
+        }
+        fault_backend = uffd_minor_backend;
+    }
+    if (!fault_backend->supports_region(prot, fd != -1)) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+    return map_region(addr, length, prot, flags, fd, offset, fault_backend);
+}
+
+/**
+ * Tear a region down: stop serving its faults, write dirty pages back,
+ * return its frames to page_pool, and release the VMA and descriptors.
+ * A failed write-back does not stop it, it is reported once the region is
+ * gone.
+ */
 int ul_munmap(void *addr, size_t length) {
+    std::shared_ptr<PFhandle_args> region;
+    {
+        std::lock_guard<std::mutex> guard(mmap_regions_mu);
+        auto it = mmap_regions.find(addr);
+        if (it == mmap_regions.end()) {
+            printf("ul_munmap: get none exist mmaping address %p\n", addr);
+            errno = EINVAL;
+            return -1;
+        }
+        region = std::move(it->second);
+        mmap_regions.erase(it);
+    }
+    PFhandle_args *pfh_args = region.get();
+
+    stop_fault_handling(pfh_args);
+    {
+        std::lock_guard<std::mutex> evict_guard(evict_mu);
+        pfh_args->releasing = true;
+        auto it = std::find(evict_regions.begin(), evict_regions.end(),
+                            pfh_args);
+        if (it != evict_regions.end()) {
+            size_t idx = it - evict_regions.begin();
+            if (idx < clock_region) clock_region--;
+            if (idx == clock_region) clock_page = 0;
+            evict_regions.erase(it);
+        }
+    }
+    // an ul_msync() or MADV_DONTNEED may still work on pinned pages
+    while (pfh_args->writers.load(std::memory_order_acquire) != 0) {
+        std::this_thread::yield();
+    }
+
+    // write back dirty pages, clear the PTEs, and release physical mems
+    int error = release_frames(pfh_args) == -1 ? errno : 0;
+    {
+        std::lock_guard<std::mutex> guard(mmap_regions_mu);
+        unmapped_stats.add(pfh_args->stats);
+    }
+
+    // release uffdio
+    struct uffdio_range uffdio_range;
+    uffdio_range.start = (__u64)addr;
+    uffdio_range.len = pfh_args->length;
+    if (ioctl(pfh_args->uffd, UFFDIO_UNREGISTER, &uffdio_range) == -1)
+        err(EXIT_FAILURE, "ioctl-UFFDIO_UNREGISTER");
+    close(pfh_args->uffd);
+    pfh_args->backend->unregister_region(addr, pfh_args->length);
+
+    // munmap: delete vma
+    munmap(addr, length);
+    if (pfh_args->alias) munmap(pfh_args->alias, pfh_args->length);
+    if (pfh_args->memfd != -1) close(pfh_args->memfd);
+
+    if (pfh_args->tail_fd != -1 && pfh_args->tail_fd != pfh_args->fd)
+        close(pfh_args->tail_fd);
+    if (pfh_args->fd != -1) close(pfh_args->fd);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int attach_page_latches(void *addr, PageLatch *latches) {
     std::lock_guard<std::mutex> guard(mmap_regions_mu);
-    auto pfh_args = mmap_regions.find(addr);
-    if (pfh_args != mmap_regions.end()) {
-        // in final version, should use region's buffer pool.
-        // Then Write back dirty page and release physical mems will be simple
-        //
-        // if is file-backed mmap, write back dirty pages
-        // release physical mems
-
-        // munmap: delete vma
-        munmap(addr, length);
-        // clear corresponse PTEs (does munmap help us clear PTEs?)
-
-        // release uffdio
-        struct uffdio_range uffdio_range;
-        uffdio_range.start = (__u64)addr;
-        uffdio_range.len = length;
-        ioctl(pfh_args->second->uffd, UFFDIO_UNREGISTER, &uffdio_range);
-
-        pfh_args->second->finish = true;
-        pfh_args->second->thread.join();
-        mmap_regions.erase(pfh_args);
-    } else {
-        printf("ul_munmap: get none exist mmaping address %p\n", addr);
+    auto it = mmap_regions.find(addr);
+    if (it == mmap_regions.end()) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::lock_guard<std::mutex> evict_guard(evict_mu);
+    it->second->latches = latches;
+    return 0;
+}
+
+// PAGE_SIZE is only set by engine_init(), the calls that validate their
+// address may come first
+static bool page_aligned(const void *addr) {
+    return (size_t)addr % sysconf(_SC_PAGE_SIZE) == 0;
+}
+
+/**
+ * Write the dirty pages of a MAP_SHARED file-backed region back to its file.
+ *
+ * Resident pages are scanned for the hardware dirty bit, which is cleared
+ * atomically (backends that can't see it write every resident page); the
+ * TLB entries of the cleared pages are invalidated before their content is
+ * written, so a write racing with the scan sets the bit again instead of
+ * going unnoticed. Runs of adjacent dirty pages are written by one pwritev().
+ *
+ * The dirty pages are pinned while evict_mu is held, and written without
+ * it: eviction and the faults of other regions don't wait for the I/O.
+ * Pages whose write-back fails stay dirty, and the error is returned.
+ */
+int ul_msync(void *addr, size_t length, int flags) {
+    if (!page_aligned(addr) ||
+        (flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) != 0 ||
+        ((flags & MS_ASYNC) && (flags & MS_SYNC))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (length == 0) return 0;
+
+    std::shared_ptr<PFhandle_args> region = find_region(addr, length);
+    if (region == nullptr) {
+        errno = ENOMEM;
+        return -1;
+    }
+    PFhandle_args *pfh_args = region.get();
+    // anonymous and private mappings have nothing to write back
+    if (pfh_args->fd == -1 || !pfh_args->shared) return 0;
+
+    size_t first_idx = ((char *)addr - (char *)pfh_args->base_addr) / PAGE_SIZE;
+    size_t last_idx = first_idx + (length + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // pinned dirty pages, and the first page of each pinned dirty huge block
+    std::vector<PinnedPage> dirty, blocks;
+    std::vector<void *> addresses;
+    FaultBackend *backend = pfh_args->backend;
+    int prot;
+    {
+        std::lock_guard<std::mutex> evict_guard(evict_mu);
+        // ul_munmap() writes them back itself
+        if (pfh_args->releasing) return 0;
+        pfh_args->writers++;
+        prot = pfh_args->prot.load(std::memory_order_relaxed);
+
+        std::vector<PinnedPage> resident;
+        if (pfh_args->dirty) {
+            // exactly the pages written since their last write-back
+            find_dirty_range(pfh_args, first_idx, last_idx, &resident);
+        } else {
+            for_each_resident(pfh_args, first_idx, last_idx,
+                              [&](size_t idx, void *frame) {
+                                  resident.push_back({idx, frame});
+                              });
+        }
+        // pinned before their dirty state is taken: a MADV_DONTNEED that
+        // pins a page first also writes it back
+        for (auto &page : resident) {
+            if (!pin_page(pfh_args, page.idx, page.frame)) continue;
+            void *address = (char *)pfh_args->base_addr + page.idx * PAGE_SIZE;
+            if (pfh_args->dirty ? pfh_args->take_dirty(page.idx)
+                                : backend->test_and_clear_dirty(address)) {
+                dirty.push_back(page);
+                addresses.push_back(address);
+            } else {
+                unpin_page(pfh_args, page.idx, page.frame);
+            }
+        }
+        // their next write faults again
+        if (pfh_args->dirty)
+            backend->write_protect(pfh_args->uffd, addresses.data(),
+                                   addresses.size(), true, prot);
+
+        for_each_huge_block(pfh_args, first_idx, last_idx, [&](size_t block_idx,
+                                                              void *frame) {
+            // the block is pinned through its first page
+            if (!pin_page(pfh_args, block_idx, frame)) return;
+            void *address = (char *)pfh_args->base_addr + block_idx * PAGE_SIZE;
+            if (!backend->test_and_clear_huge_dirty(address)) {
+                unpin_page(pfh_args, block_idx, frame);
+                return;
+            }
+            blocks.push_back({block_idx, frame});
+            addresses.push_back(address);
+        });
+        backend->flush_tlb(addresses.data(), addresses.size());
+    }
+
+    std::vector<PinnedPage> pages = dirty;
+    for (auto &block : blocks) {
+        // one TLB entry maps the block, the dirty bit covers all of it
+        for (size_t i = 0; i < PAGES_PER_PT; i++)
+            pages.push_back(
+                {block.idx + i, (char *)block.frame + i * PAGE_SIZE});
+    }
+    std::sort(pages.begin(), pages.end(),
+              [](const PinnedPage &a, const PinnedPage &b) {
+                  return a.idx < b.idx;
+              });
+    std::vector<PinnedPage> failed;
+    int ret = write_back_pages(pfh_args, pages, &failed);
+    int error = errno;
+    // marked dirty again while pinned, the next ul_msync() retries them
+    for (auto &page : failed) {
+        void *address = (char *)pfh_args->base_addr + page.idx * PAGE_SIZE;
+        if (pfh_args->huge_block(pfh_args->block_index(page.idx))) {
+            // the block's pages are listed in order, mark it once
+            if ((size_t)address % HUGE_PAGE_SIZE == 0)
+                backend->set_huge_dirty(address);
+        } else if (pfh_args->dirty) {
+            pfh_args->set_dirty(page.idx);
+        } else {
+            backend->set_dirty(address);
+        }
+    }
+
+    for (auto &page : dirty) unpin_page(pfh_args, page.idx, page.frame);
+    for (auto &block : blocks) unpin_page(pfh_args, block.idx, block.frame);
+    // a ul_mprotect() meanwhile skipped the pinned pages
+    recheck_protection(pfh_args, prot, first_idx,
+                       std::min(last_idx, pfh_args->num_pages) - first_idx);
+
+    if ((flags & MS_SYNC) && fdatasync(pfh_args->fd) == -1 && ret == 0) {
+        ret = -1;
+        error = errno;
+    }
+    pfh_args->writers.fetch_sub(1, std::memory_order_release);
+    if (ret == -1) errno = error;
+    return ret;
+}
+
+int ul_get_stats(void *addr, struct ul_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (addr != NULL) {
+        std::shared_ptr<PFhandle_args> region = find_region(addr, 1);
+        if (!region) {
+            errno = EINVAL;
+            return -1;
+        }
+        region->stats.add_to(stats);
+        stats->resident_pages = region->resident_pages.load();
+        return 0;
+    }
+    std::lock_guard<std::mutex> guard(mmap_regions_mu);
+    unmapped_stats.add_to(stats);
+    for (auto &entry : mmap_regions) {
+        entry.second->stats.add_to(stats);
+        stats->resident_pages += entry.second->resident_pages.load();
+    }
+    return 0;
+}
+
+uint64_t ul_stats_latency_percentile(const struct ul_stats *stats, double p) {
+    if (!(p > 0 && p <= 1)) {
+        errno = EINVAL;
+        return 0;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < UL_LATENCY_BUCKETS; i++)
+        total += stats->fault_latency[i];
+    if (total == 0) return 0;
+    // the p * total-th fastest fault, at least the fastest one: rank 0
+    // would match the first bucket even if it is empty
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(p * total));
+    uint64_t seen = 0;
+    for (int i = 0; i < UL_LATENCY_BUCKETS - 1; i++) {
+        seen += stats->fault_latency[i];
+        if (seen >= rank) return 2ull << i;
+    }
+    return UINT64_MAX;
+}
+
+static void print_stats(FILE *out, const char *name,
+                        const struct ul_stats *stats) {
+    fprintf(out,
+            "%s: faults %lu (read %lu, write %lu), read %lu bytes, resident "
+            "%lu pages, evictions %lu, write-backs %lu, fault latency p50 "
+            "<%luns p99 <%luns\n",
+            name, stats->faults, stats->read_faults, stats->write_faults,
+            stats->bytes_read, stats->resident_pages, stats->evictions,
+            stats->write_backs, ul_stats_latency_percentile(stats, 0.50),
+            ul_stats_latency_percentile(stats, 0.99));
+}
+
+void ul_dump_stats(FILE *out) {
+    struct ul_stats stats;
+    ul_get_stats(NULL, &stats);
+    print_stats(out, "all regions", &stats);
+
+    std::lock_guard<std::mutex> guard(mmap_regions_mu);
+    for (auto &entry : mmap_regions) {
+        PFhandle_args *pfh_args = entry.second.get();
+        memset(&stats, 0, sizeof(stats));
+        pfh_args->stats.add_to(&stats);
+        stats.resident_pages = pfh_args->resident_pages.load();
+        char name[64];
+        snprintf(name, sizeof(name), "region %p (%zu pages)",
+                 pfh_args->base_addr, pfh_args->num_pages);
+        print_stats(out, name, &stats);
+    }
+}
+
+struct PrefetchRequest {
+    std::shared_ptr<PFhandle_args> region;
+    size_t first_idx;
+    size_t last_idx;
+};
+
+// the prefetch thread outlives static destruction, so does its queue
+struct PrefetchQueue {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<PrefetchRequest> requests;
+};
+
+static std::once_flag prefetch_init_flag;
+static PrefetchQueue *prefetch_queue = nullptr;
+
+/**
+ * Read the missing pages of region pages [first_idx, last_idx) in without
+ * faulting on them. Runs of missing pages are claimed like a fault-around
+ * window, at most ul_config.fault_around_pages and never across a PT page,
+ * and read through an io_uring, or right here without one; a fault on a
+ * claimed page waits for the run. No page is evicted for a prefetch, it
+ * stops where the pool runs dry.
+ */
+static void prefetch_range(PFhandle_args *pfh_args, size_t first_idx,
+                           size_t last_idx) {
+    FaultBackend *backend = pfh_args->backend;
+    size_t base_pfn = (size_t)pfh_args->base_addr / PAGE_SIZE;
+    for (size_t idx = first_idx; idx < last_idx;) {
+        if (pfh_args->unmapping.load(std::memory_order_acquire)) return;
+        size_t block_end = std::min(
+            ((base_pfn + idx) / PAGES_PER_PT + 1) * PAGES_PER_PT - base_pfn,
+            last_idx);
+        void *address = (char *)pfh_args->base_addr + idx * PAGE_SIZE;
+        if (!backend->can_map(address)) {
+            idx = block_end;
+            continue;
+        }
+        if (!claim_page(pfh_args, idx)) {
+            idx++;
+            continue;
+        }
+        size_t run_last = idx + 1;
+        while (run_last < block_end &&
+               run_last - idx < engine_config.fault_around_pages &&
+               claim_page(pfh_args, run_last))
+            run_last++;
+
+        void *frames[MAX_FAULT_AROUND_PAGES];
+        size_t count = 0;
+        for (; idx + count < run_last; count++) {
+            frames[count] = page_frame(pfh_args, idx + count, false);
+            if (frames[count] == nullptr) break;
+        }
+        bool dry = idx + count < run_last;
+        unclaim_pages(pfh_args, idx + count, run_last - idx - count);
+        if (count == 0) return;
+
+        size_t ring = io_rings.empty() ? 0 : next_ring++ % io_rings.size();
+        if (!io_rings.empty() &&
+            submit_read(pfh_args, ring, idx, count, frames,
+                        std::chrono::steady_clock::now(), true)) {
+            io_rings[ring]->submit();
+        } else {
+            size_t nr_data = fill_frames(pfh_args, idx, count, frames);
+            map_frames(pfh_args, idx, count, frames, nr_data);
+            wake_range(pfh_args, (__u64)address, count * PAGE_SIZE);
+        }
+        if (dry) return;
+        idx += count;
+    }
+}
+
+/**
+ * Prefetch the queued MADV_WILLNEED ranges, one after the other. The reads
+ * of a range overlap through the io_uring, the thread only claims them.
+ */
+static void prefetch_loop() {
+    for (;;) {
+        PrefetchRequest req;
+        {
+            std::unique_lock<std::mutex> lock(prefetch_queue->mu);
+            prefetch_queue->cv.wait(
+                lock, [] { return !prefetch_queue->requests.empty(); });
+            req = std::move(prefetch_queue->requests.front());
+            prefetch_queue->requests.pop_front();
+        }
+        PFhandle_args *pfh_args = req.region.get();
+        prefetch_range(pfh_args, req.first_idx, req.last_idx);
+        pfh_args->prefetches.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+/**
+ * Drop the resident pages of region pages [first_idx, last_idx), like
+ * ul_munmap() does for the whole region. A huge block is only dropped if
+ * the range covers all of it. Returns like release_range().
+ */
+static int drop_range(PFhandle_args *pfh_args, size_t first_idx,
+                      size_t last_idx) {
+    size_t base_pfn = (size_t)pfh_args->base_addr / PAGE_SIZE;
+    auto block_start = [&](size_t idx) {
+        return ((base_pfn + idx) / PAGES_PER_PT) * PAGES_PER_PT - base_pfn;
+    };
+    if (pfh_args->huge_block(pfh_args->block_index(first_idx)) &&
+        block_start(first_idx) != first_idx)
+        first_idx = block_start(first_idx) + PAGES_PER_PT;
+    if (last_idx > first_idx &&
+        pfh_args->huge_block(pfh_args->block_index(last_idx - 1)) &&
+        last_idx != pfh_args->num_pages &&
+        block_start(last_idx) != last_idx)
+        last_idx = block_start(last_idx);
+    if (first_idx >= last_idx) return 0;
+
+    {
+        std::lock_guard<std::mutex> evict_guard(evict_mu);
+        if (pfh_args->releasing) return 0;
+        pfh_args->writers++;
+    }
+    // the pages are pinned one by one, eviction and ul_msync() skip them
+    int ret = release_range(pfh_args, first_idx, last_idx, true);
+    pfh_args->writers.fetch_sub(1, std::memory_order_release);
+    return ret;
+}
+
+/**
+ * Advise the engine about the use of a range of a region:
+ *   MADV_WILLNEED   the missing pages of a readable file-backed region are
+ *                   read in the background, the call does not wait for
+ *                   them; huge regions ignore it
+ *   MADV_DONTNEED   the resident pages are dropped and their frames go back
+ *                   to the pool; dirty pages of MAP_SHARED file-backed
+ *                   regions are written back first, the others read as the
+ *                   file or as zeros again; a failed write-back is returned,
+ *                   the pages are dropped all the same
+ *   MADV_SEQUENTIAL faults of the region map the largest fault-around window
+ *   MADV_RANDOM     faults of the region map single pages
+ *   MADV_NORMAL     the window adapts to the access pattern again
+ * The fault-around advice applies to the whole region.
+ */
+int ul_madvise(void *addr, size_t length, int advice) {
+    if (!page_aligned(addr)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (length == 0) return 0;
+
+    std::shared_ptr<PFhandle_args> region = find_region(addr, length);
+    if (region == nullptr) {
+        errno = ENOMEM;
+        return -1;
+    }
+    PFhandle_args *pfh_args = region.get();
+    size_t first_idx = ((char *)addr - (char *)pfh_args->base_addr) / PAGE_SIZE;
+    size_t last_idx = std::min(first_idx + (length + PAGE_SIZE - 1) / PAGE_SIZE,
+                               pfh_args->num_pages);
+
+    switch (advice) {
+        case MADV_NORMAL:
+        case MADV_SEQUENTIAL:
+        case MADV_RANDOM:
+            pfh_args->advice.store(advice, std::memory_order_relaxed);
+            return 0;
+        case MADV_WILLNEED:
+            // anonymous memory has nothing to read, the faults of huge
+            // regions map whole blocks, and unreadable pages stay missing
+            if (pfh_args->fd == -1 || pfh_args->huge_frames ||
+                !(pfh_args->prot.load(std::memory_order_relaxed) & PROT_READ))
+                return 0;
+            std::call_once(prefetch_init_flag, [] {
+                prefetch_queue = new PrefetchQueue();
+                std::thread(prefetch_loop).detach();
+            });
+            pfh_args->prefetches++;
+            {
+                std::lock_guard<std::mutex> guard(prefetch_queue->mu);
+                prefetch_queue->requests.push_back(
+                    {region, first_idx, last_idx});
+            }
+            prefetch_queue->cv.notify_one();
+            return 0;
+        case MADV_DONTNEED:
+            return drop_range(pfh_args, first_idx, last_idx);
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/**
+ * Change the protection of a whole region to prot. Regions whose backend
+ * installs the pages itself are not mprotect()ed, the kernel would split
+ * the VMA under the installed entries: the permission bits of the resident
+ * pages are rewritten in place with one TLB flush, and later faults install
+ * the new ones. A write to such a region without PROT_WRITE gets a SIGSEGV
+ * from the fault handler. With the other backends, the kernel's VMA carries
+ * the protection.
+ */
+int ul_mprotect(void *addr, size_t length, int prot) {
+    if (!page_aligned(addr) ||
+        (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::shared_ptr<PFhandle_args> region = find_region(addr, length);
+    if (region == nullptr) {
+        errno = ENOMEM;
+        return -1;
+    }
+    PFhandle_args *pfh_args = region.get();
+    // the protection is kept per region
+    if (addr != pfh_args->base_addr ||
+        (length + PAGE_SIZE - 1) / PAGE_SIZE != pfh_args->num_pages) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    FaultBackend *backend = pfh_args->backend;
+    if (!backend->maps_frames()) {
+        if (!backend->supports_region(prot, pfh_args->fd != -1)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (mprotect(addr, length, prot) == -1) return -1;
+        pfh_args->prot.store(prot, std::memory_order_relaxed);
+        return 0;
+    }
+    // PTEs can't deny reads, and huge PMDs keep theirs
+    if (!(prot & PROT_READ) || pfh_args->huge_frames) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // eviction and ul_munmap() must not unmap the pages meanwhile
+    std::lock_guard<std::mutex> evict_guard(evict_mu);
+    if (pfh_args->releasing) {
+        errno = ENOMEM;
+        return -1;
     }
+    pfh_args->prot.store(prot, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    protect_range(pfh_args, 0, pfh_args->num_pages, prot);
     return 0;
 }